@@ -1,19 +1,119 @@
 #pragma once
 
 #include "resource.h"
+#include "utils/tile_scheduler.h"
 
+#include <DirectXMath.h>
+#include <algorithm>
+#include <array>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RASTERIZER_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RASTERIZER_TARGET_AVX2
+#else
+// Vector path is compiled for AVX2 regardless of build flags and only called on CPUs supporting it
+#define RASTERIZER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 
 using namespace linalg::aliases;
 
 namespace cg::renderer
 {
-	template<typename VB, typename RT>
-	class rasterizer
+	// Per-draw transformations, combined once instead of being rebuilt for every vertex
+	struct draw_constants
+	{
+		DirectX::XMMATRIX world;
+		DirectX::XMMATRIX view;
+		DirectX::XMMATRIX projection;
+		DirectX::XMMATRIX world_view_projection;
+		DirectX::XMMATRIX viewport; // clip space to screen space before the perspective division
+	};
+
+	// Faces removed before rasterization by their winding on screen
+	enum class cull_mode
+	{
+		none,
+		front,
+		back
+	};
+
+#ifdef RASTERIZER_AVX2
+	// Checked once per process, the binary runs on CPUs without AVX2 as well
+	inline bool cpu_has_avx2()
+	{
+		static const bool result = [] {
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7) {
+				return false;
+			}
+			// OS has to save YMM registers on context switches too
+			__cpuid(info, 1);
+			const bool has_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 0x6) == 0x6;
+			__cpuidex(info, 7, 0);
+			return has_avx && (info[1] & (1 << 5)) != 0;
+#else
+			return __builtin_cpu_supports("avx2") != 0;
+#endif
+		}();
+		return result;
+	}
+#endif
+
+	// Float attribute of a vertex read by a pixel shader, e.g. {offsetof(vertex, normal), 3}
+	struct varying
+	{
+		size_t offset;
+		size_t count;
+	};
+
+	// Shaders may declare the attributes their pixel shader reads as a static constexpr std::array<varying, N> varyings.
+	// Only those are interpolated, the rest keep the values of the first vertex of the triangle.
+	// Without the declaration every attribute is interpolated
+	template<typename SHADER, typename = void>
+	struct shader_varyings
+	{
+		static constexpr bool is_declared = false;
+		static constexpr size_t num_components = 0;
+	};
+
+	template<typename SHADER>
+	struct shader_varyings<SHADER, std::void_t<decltype(SHADER::varyings)>>
+	{
+		static constexpr bool is_declared = true;
+		static constexpr size_t num_components = [] {
+			size_t result = 0;
+			for (const varying& attribute : SHADER::varyings) {
+				result += attribute.count;
+			}
+			return result;
+		}();
+	};
+
+	// Fallback shader policy, shaders are assigned at runtime for quick experiments
+	template<typename VB>
+	struct dynamic_shader
+	{
+		std::function<VB(VB vertex_data)> vertex_shader = [](VB vertex_data) { return vertex_data; };
+		std::function<cg::color(const VB& vertex_data, const float b, float& z)> pixel_shader;
+	};
+
+	// SHADER is a policy providing vertex_shader(VB) -> VB and pixel_shader(const VB&, float, float&) -> color.
+	// Pixel shader may replace the depth it gets, which is tested only with early depth test turned off.
+	// A concrete policy is bound at compile time, so its shaders are inlined into the raster loop
+	template<typename VB, typename RT, typename SHADER = dynamic_shader<VB>>
+	class rasterizer : public SHADER
 	{
 	public:
 		rasterizer(){};
@@ -28,11 +128,22 @@ namespace cg::renderer
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		void set_depth_range(float in_min_depth, float in_max_depth);
 
-		void draw(size_t num_indices);
+		void set_transform(DirectX::FXMMATRIX world, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection);
+		const draw_constants& get_constants() const;
 
-		std::function<VB(VB vertex_data)> vertex_shader;
-		std::function<cg::color(const VB& vertex_data, const float b, const float z)> pixel_shader;
+		// Without scheduler the whole viewport is rasterized as one tile on the calling thread
+		void set_scheduler(std::shared_ptr<utils::tile_scheduler> in_scheduler);
+
+		// Applies to the following draws. Front faces are the ones wound counter-clockwise on screen,
+		// unless in_front_counter_clockwise is false
+		void set_cull_mode(cull_mode in_cull_mode, bool in_front_counter_clockwise = true);
+		// Applies to the following draws. Without early depth test every covered pixel is shaded before
+		// the depth written by its shader is tested, which shaders writing depth or having side effects rely on
+		void set_early_depth_test(bool in_early_depth_test);
+
+		void draw(size_t num_indices);
 
 	protected:
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
@@ -40,15 +151,113 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<RT>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
 
+		std::shared_ptr<utils::tile_scheduler> scheduler;
+
 		size_t width = 1920;
 		size_t height = 1080;
-
-		float edge_function(float2 a, float2 b, float2 c);
+		float min_depth = 0.0f;
+		float max_depth = 1.0f;
+		cull_mode cull = cull_mode::back;
+		bool front_counter_clockwise = true;
+		bool early_depth_test = true;
+
+		// Triangles are clipped only when they reach this many pixels beyond the viewport,
+		// closer ones are left to the bounding box clamp
+		static constexpr float guard_band = 2048.0f;
+
+		draw_constants constants{};
+
+		// Post-transform copy of the vertex buffer, every vertex is processed once per draw.
+		// Positions are kept in homogeneous clip space until triangles are clipped
+		std::vector<VB> transformed_vertices;
+		std::vector<DirectX::XMFLOAT4> clip_positions;
+
+		void process_vertices();
+
+		struct clip_vertex
+		{
+			DirectX::XMFLOAT4 position;
+			VB data;
+		};
+
+		// Planes a vertex is outside of, frustum and near ones are used for trivial rejection,
+		// near and guard band ones for clipping
+		static constexpr unsigned frustum_left = 1u << 0;
+		static constexpr unsigned frustum_right = 1u << 1;
+		static constexpr unsigned frustum_bottom = 1u << 2;
+		static constexpr unsigned frustum_top = 1u << 3;
+		static constexpr unsigned frustum_far = 1u << 4;
+		static constexpr unsigned clip_near = 1u << 5;
+		static constexpr unsigned guard_left = 1u << 6;
+		static constexpr unsigned guard_right = 1u << 7;
+		static constexpr unsigned guard_bottom = 1u << 8;
+		static constexpr unsigned guard_top = 1u << 9;
+		static constexpr unsigned reject_planes = frustum_left | frustum_right | frustum_bottom | frustum_top |
+												  frustum_far | clip_near;
+		static constexpr unsigned clip_planes = clip_near | guard_left | guard_right | guard_bottom | guard_top;
+
+		unsigned get_outcode(const DirectX::XMFLOAT4& position) const;
+		float get_plane_distance(const DirectX::XMFLOAT4& position, unsigned plane) const;
+
+		// Clip the face against the planes it crosses and set up the triangles of the result
+		void clip_triangle(const std::array<clip_vertex, 3>& face, unsigned planes);
+		// Perspective division and viewport transform of a triangle inside of the clip volume
+		void emit_triangle(const clip_vertex& a, const clip_vertex& b, const clip_vertex& c);
+
+		using varyings = shader_varyings<SHADER>;
+
+		// Post vertex shader triangle with everything needed to rasterize it in any tile
+		struct triangle
+		{
+			std::array<VB, 3> face;
+			std::array<float2, 3> positions;
+			// Plane equations of declared varyings: value = z + x * (px - v0.x) + y * (py - v0.y)
+			std::array<float3, varyings::num_components> varying_planes;
+			float orientation;
+			float inv_area_twice;
+			float z_min; // depth is interpolated linearly on screen, so no pixel is closer than the closest vertex
+			int xfrom, xto, yfrom, yto; // pixels which centers may be covered
+		};
+
+		// Triangles of the current draw call and their indices binned per screen tile
+		std::vector<triangle> triangles;
+		std::vector<std::vector<unsigned>> bins;
+
+		// Hierarchical Z: the farthest depth of every hi_z_tile x hi_z_tile block of the depth buffer.
+		// It is only ever lowered by drawing, so a stale value is still a safe bound
+		static constexpr size_t hi_z_tile = 8;
+		std::vector<float> hi_z;
+		size_t hi_z_stride = 0;
+
+		bool setup_triangle(const std::array<VB, 3>& face, triangle& out_triangle);
+		void rasterize_triangle(const triangle& tri, const utils::tile& tile, bool use_hi_z);
+		// Attributes of the pixel read by the pixel shader are written into pixel_data
+		void interpolate(const triangle& tri, VB& pixel_data, int x, int y, float u, float v, float w) const;
+
+#ifdef RASTERIZER_AVX2
+		// Coverage and early depth test of up to 8 pixels of a row starting at x_begin in vector registers,
+		// passing depths are stored with a masked write and their pixels are shaded one by one.
+		// Returns true if any depth was written
+		RASTERIZER_TARGET_AVX2 bool rasterize_span_avx2(
+				const triangle& tri, VB& pixel_data, const std::array<float, 3>& row, const std::array<float, 3>& step_x,
+				const std::array<bool, 3>& is_top_left, int x_begin, int x_end, int y);
+#endif
+
+		// True if the triangle is behind everything drawn in all blocks it may cover inside the tile
+		bool is_occluded(const triangle& tri, const utils::tile& tile) const;
+		void update_hi_z(size_t block_x, size_t block_y);
+
+		float edge_function(float2 a, float2 b, float2 c) const;
 		bool depth_test(float z, size_t x, size_t y);
+
+		static float* get_component(VB& vertex_data, size_t offset)
+		{
+			return reinterpret_cast<float*>(reinterpret_cast<char*>(&vertex_data) + offset);
+		}
 	};
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target,
 			std::shared_ptr<resource<float>> in_depth_buffer)
 	{
@@ -57,8 +266,8 @@ namespace cg::renderer
 		depth_buffer = in_depth_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::clear_render_target(
 			const float in_depth)
 	{
 		//THROW_ERROR("Not implemented yet");
@@ -77,126 +286,591 @@ namespace cg::renderer
 					depth_buffer->item(x, y) = in_depth;
 				}
 			}
+			hi_z_stride = (width + hi_z_tile - 1) / hi_z_tile;
+			hi_z.assign(hi_z_stride * ((height + hi_z_tile - 1) / hi_z_tile), in_depth);
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_vertex_buffer(
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_vertex_buffer(
 			std::shared_ptr<resource<VB>> in_vertex_buffer)
 	{
 		//THROW_ERROR("Not implemented yet");
 		vertex_buffer = in_vertex_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_index_buffer(
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_index_buffer(
 			std::shared_ptr<resource<unsigned int>> in_index_buffer)
 	{
 		//THROW_ERROR("Not implemented yet");
 		index_buffer = in_index_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_viewport(size_t in_width, size_t in_height)
 	{
 		//THROW_ERROR("Not implemented yet");
 		width = in_width;
 		height = in_height;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::draw(size_t num_indices)
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_depth_range(float in_min_depth, float in_max_depth)
+	{
+		min_depth = in_min_depth;
+		max_depth = in_max_depth;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_transform(
+			DirectX::FXMMATRIX world, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection)
+	{
+		constants.world = world;
+		constants.view = view;
+		constants.projection = projection;
+		constants.world_view_projection = DirectX::XMMatrixMultiply(DirectX::XMMatrixMultiply(world, view), projection);
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline const draw_constants& rasterizer<VB, RT, SHADER>::get_constants() const
+	{
+		return constants;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_scheduler(std::shared_ptr<utils::tile_scheduler> in_scheduler)
+	{
+		scheduler = in_scheduler;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_cull_mode(cull_mode in_cull_mode, bool in_front_counter_clockwise)
+	{
+		cull = in_cull_mode;
+		front_counter_clockwise = in_front_counter_clockwise;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::set_early_depth_test(bool in_early_depth_test)
+	{
+		early_depth_test = in_early_depth_test;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::draw(size_t num_indices)
 	{
 		//THROW_ERROR("Not implemented yet");
+		// VS STAGE: Transform every vertex of the buffer once
+		process_vertices();
+
+		triangles.clear();
+		triangles.reserve(num_indices / 3);
 		for (size_t face_idx = 0; face_idx != num_indices / 3; ++face_idx) {
 
-			// IA STAGE: Extract face from vertex buffer
-			std::array<vertex, 3> face{};
+			// IA STAGE: Extract face from post-transform vertices
+			std::array<clip_vertex, 3> face;
+			std::array<unsigned, 3> outcodes;
 			for (size_t i = 0; i != 3; ++i) {
-				face[i] = vertex_buffer->item(index_buffer->item(3 * face_idx + i));
+				const unsigned index = index_buffer->item(3 * face_idx + i);
+				face[i] = {clip_positions[index], transformed_vertices[index]};
+				outcodes[i] = get_outcode(face[i].position);
 			}
 
-			
-			// VS STAGE : Execute vertex shader
-			std::array<float3, 3> vertices;
-			for (size_t i = 0; i != 3; ++i) {
-				face[i] = vertex_shader(face[i]);
-				vertices[i] = float3(&face[i].position.x);
+			// CLIP STAGE: Faces outside of one frustum plane, the near one included, are dropped,
+			// faces inside of the guard band go straight to setup, only the rest is clipped
+			if ((outcodes[0] & outcodes[1] & outcodes[2]) & reject_planes) {
+				continue;
 			}
+			const unsigned crossed = (outcodes[0] | outcodes[1] | outcodes[2]) & clip_planes;
+			if (crossed == 0) {
+				emit_triangle(face[0], face[1], face[2]);
+			}
+			else {
+				clip_triangle(face, crossed);
+			}
+		}
 
-			// Calculating rendering domain
-			float ymin = std::min_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.y < b.y; })->y;
-			float ymax = std::max_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.y < b.y; })->y;
+		// BINNING STAGE: Sort triangles into screen tiles. Triangles are appended in submission order,
+		// so every tile draws them in the same order as a serial rasterizer would
+		const size_t tile_size = scheduler ? scheduler->get_tile_size() : std::max(width, height);
+		const size_t tiles_x = (width + tile_size - 1) / tile_size;
+		const size_t tiles_y = (height + tile_size - 1) / tile_size;
+		bins.resize(tiles_x * tiles_y);
+		for (auto& bin : bins) {
+			bin.clear();
+		}
+		for (size_t triangle_idx = 0; triangle_idx != triangles.size(); ++triangle_idx) {
+			const triangle& tri = triangles[triangle_idx];
+			for (size_t ty = tri.yfrom / tile_size; ty <= (tri.yto - 1) / tile_size; ++ty) {
+				for (size_t tx = tri.xfrom / tile_size; tx <= (tri.xto - 1) / tile_size; ++tx) {
+					bins[ty * tiles_x + tx].push_back(static_cast<unsigned>(triangle_idx));
+				}
+			}
+		}
 
-			//ymin = (ymin + 1) / 2 * (height - 1);
-			//ymax = (ymax + 1) / 2 * (height - 1);
+		// Hi-Z blocks have to be owned by one tile, otherwise they would be updated by two threads
+		// Hi-Z rejects pixels before shading too, so it is off together with early depth test.
+		// Depth written meanwhile only gets closer, so the skipped updates keep Hi-Z conservative
+		const bool use_hi_z = early_depth_test && !hi_z.empty() && (!scheduler || tile_size % hi_z_tile == 0);
+
+		// RASTERIZATION STAGE: Every tile owns its pixels of render target and depth buffer,
+		// so tiles are processed in parallel without locking
+		auto rasterize_tile = [&](const utils::tile& tile) {
+			const auto& bin = bins[(tile.y_begin / tile_size) * tiles_x + tile.x_begin / tile_size];
+			for (unsigned triangle_idx : bin) {
+				const triangle& tri = triangles[triangle_idx];
+				// Whole triangle is rejected before any pixel work
+				if (use_hi_z && is_occluded(tri, tile)) {
+					continue;
+				}
+				rasterize_triangle(tri, tile, use_hi_z);
+			}
+		};
 
-			int yfrom = (std::clamp(static_cast<int>(std::ceil(ymin)), 0, static_cast<int>(height - 1)));
-			int yto = (std::clamp(static_cast<int>(std::ceil(ymax)), 0, static_cast<int>(height - 1)));
+		if (scheduler) {
+			scheduler->run(width, height, rasterize_tile);
+		}
+		else {
+			rasterize_tile({0, 0, width, height});
+		}
+	}
 
-			float xmin = std::min_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.x < b.x; })->x;
-			float xmax = std::max_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.x < b.x; })->x;
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::process_vertices()
+	{
+		using namespace DirectX;
+
+		// Viewport transform maps NDC into [0, width] x [0, height] x [min_depth, max_depth] with Y looking down.
+		// It keeps W intact, so it is folded into the matrix applied before the perspective division
+		const float half_width = 0.5f * static_cast<float>(width);
+		const float half_height = 0.5f * static_cast<float>(height);
+		constants.viewport = XMMatrixSet(
+				half_width, 0.0f, 0.0f, 0.0f,
+				0.0f, -half_height, 0.0f, 0.0f,
+				0.0f, 0.0f, max_depth - min_depth, 0.0f,
+				half_width, half_height, min_depth, 1.0f);
+
+		const size_t num_vertices = vertex_buffer->get_number_of_elements();
+		transformed_vertices.resize(num_vertices);
+		clip_positions.resize(num_vertices);
+		if (num_vertices == 0) {
+			return;
+		}
+		std::copy(vertex_buffer->get_data(), vertex_buffer->get_data() + num_vertices, transformed_vertices.begin());
 
-			//xmin = (xmin + 1) / 2 * (width - 1);
-			//xmax = (xmax + 1) / 2 * (width - 1);
-			
-			int xfrom = (std::clamp(static_cast<int>(std::ceil(xmin)), 0, static_cast<int>(width - 1)));
-			int xto = (std::clamp(static_cast<int>(std::ceil(xmax)), 0, static_cast<int>(width - 1)));
+		// Positions are transformed into clip space as one strided SIMD stream, W is kept for clipping
+		XMVector3TransformStream(clip_positions.data(), sizeof(XMFLOAT4),
+								 &vertex_buffer->get_data()->position, sizeof(VB),
+								 num_vertices, constants.world_view_projection);
 
-			// Find triangle screen area
-			float area_twice = (cross(vertices[1] - vertices[0], vertices[2] - vertices[0])).z;
+		// Vertex shader runs once per vertex, its position is replaced by the screen one after clipping
+		for (VB& vertex_data : transformed_vertices) {
+			vertex_data = this->vertex_shader(vertex_data);
+		}
+	}
 
-			for (int y = yfrom; y < yto; ++y) {
-				for (int x = xfrom; x < xto; ++x) {
+	template<typename VB, typename RT, typename SHADER>
+	inline unsigned rasterizer<VB, RT, SHADER>::get_outcode(const DirectX::XMFLOAT4& position) const
+	{
+		// Guard band in NDC units, viewport spans [-1, 1]
+		const float guard_x = 1.0f + 2.0f * guard_band / static_cast<float>(width);
+		const float guard_y = 1.0f + 2.0f * guard_band / static_cast<float>(height);
+		const float w = position.w;
+		unsigned code = 0;
+		code |= position.x < -w ? frustum_left : 0u;
+		code |= position.x > w ? frustum_right : 0u;
+		code |= position.y < -w ? frustum_bottom : 0u;
+		code |= position.y > w ? frustum_top : 0u;
+		code |= position.z > w ? frustum_far : 0u;
+		code |= position.z < 0.0f ? clip_near : 0u;
+		code |= position.x < -guard_x * w ? guard_left : 0u;
+		code |= position.x > guard_x * w ? guard_right : 0u;
+		code |= position.y < -guard_y * w ? guard_bottom : 0u;
+		code |= position.y > guard_y * w ? guard_top : 0u;
+		return code;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline float rasterizer<VB, RT, SHADER>::get_plane_distance(const DirectX::XMFLOAT4& position, unsigned plane) const
+	{
+		const float guard_x = 1.0f + 2.0f * guard_band / static_cast<float>(width);
+		const float guard_y = 1.0f + 2.0f * guard_band / static_cast<float>(height);
+		switch (plane) {
+			case guard_left:
+				return position.x + guard_x * position.w;
+			case guard_right:
+				return guard_x * position.w - position.x;
+			case guard_bottom:
+				return position.y + guard_y * position.w;
+			case guard_top:
+				return guard_y * position.w - position.y;
+			default:// near plane
+				return position.z;
+		}
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::clip_triangle(const std::array<clip_vertex, 3>& face, unsigned planes)
+	{
+		using namespace DirectX;
+
+		// Sutherland-Hodgman against every crossed plane, each of them adds at most one vertex.
+		// Attributes are interpolated in clip space, where they are still linear
+		constexpr size_t max_vertices = 3 + 5;
+		std::array<clip_vertex, max_vertices> polygon, clipped;
+		std::copy(face.begin(), face.end(), polygon.begin());
+		size_t num_vertices = 3;
+
+		for (unsigned plane = clip_near; plane <= guard_top && num_vertices != 0; plane <<= 1) {
+			if (!(planes & plane)) {
+				continue;
+			}
+			size_t num_clipped = 0;
+			for (size_t i = 0; i != num_vertices; ++i) {
+				const clip_vertex& current = polygon[i];
+				const clip_vertex& next = polygon[(i + 1) % num_vertices];
+				const float d_current = get_plane_distance(current.position, plane);
+				const float d_next = get_plane_distance(next.position, plane);
+				if (d_current >= 0.0f) {
+					clipped[num_clipped++] = current;
+				}
+				if ((d_current >= 0.0f) != (d_next >= 0.0f)) {
+					const float t = d_current / (d_current - d_next);
+					clip_vertex& intersection = clipped[num_clipped++];
+					XMStoreFloat4(&intersection.position, XMVectorLerp(XMLoadFloat4(&current.position),
+																	   XMLoadFloat4(&next.position), t));
+					intersection.data = current.data * (1.0f - t) + next.data * t;
+				}
+			}
+			std::swap(polygon, clipped);
+			num_vertices = num_clipped;
+		}
+
+		// Clipped polygon is convex, so it is a fan around its first vertex
+		for (size_t i = 1; i + 1 < num_vertices; ++i) {
+			emit_triangle(polygon[0], polygon[i], polygon[i + 1]);
+		}
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::emit_triangle(const clip_vertex& a, const clip_vertex& b, const clip_vertex& c)
+	{
+		using namespace DirectX;
+		std::array<VB, 3> face{a.data, b.data, c.data};
+		const std::array<const clip_vertex*, 3> sources{&a, &b, &c};
+		for (size_t i = 0; i != 3; ++i) {
+			const XMVECTOR screen = XMVector4Transform(XMLoadFloat4(&sources[i]->position), constants.viewport);
+			XMStoreFloat3(&face[i].position, XMVectorDivide(screen, XMVectorSplatW(screen)));
+		}
 
-					// Calculate pixel baricentric coordinates
-					float xf = static_cast<float>(x);
-					float yf = static_cast<float>(y);
-					float3 current_point{static_cast<float>(xf), static_cast<float>(yf), 0.0f};
+		triangles.emplace_back();
+		if (!setup_triangle(face, triangles.back())) {
+			triangles.pop_back();
+		}
+	}
 
-					float u = abs(cross(vertices[1] - current_point, vertices[2] - current_point).z) / area_twice;
-					float v = abs(cross(vertices[0] - current_point, vertices[2] - current_point).z) / area_twice;
-					float w = abs(cross(vertices[0] - current_point, vertices[1] - current_point).z) / area_twice;
+	template<typename VB, typename RT, typename SHADER>
+	inline bool rasterizer<VB, RT, SHADER>::setup_triangle(const std::array<VB, 3>& face, triangle& out_triangle)
+	{
+		// TRIANGLE SETUP: Signed area gives the winding, it is positive for counter-clockwise faces on screen
+		const float2 v0{face[0].position.x, face[0].position.y};
+		const float2 v1{face[1].position.x, face[1].position.y};
+		const float2 v2{face[2].position.x, face[2].position.y};
+		const float area_twice = edge_function(v0, v1, v2);
+		if (area_twice == 0.0f) {
+			return false;// degenerate triangle covers no pixels
+		}
+		if (cull != cull_mode::none) {
+			const bool is_front = (area_twice > 0.0f) == front_counter_clockwise;
+			if (is_front == (cull == cull_mode::front)) {
+				return false;
+			}
+		}
+
+		// Calculating rendering domain: pixels which centers may be inside of the triangle
+		const float xmin = std::min({v0.x, v1.x, v2.x});
+		const float xmax = std::max({v0.x, v1.x, v2.x});
+		const float ymin = std::min({v0.y, v1.y, v2.y});
+		const float ymax = std::max({v0.y, v1.y, v2.y});
+
+		out_triangle.xfrom = std::clamp(static_cast<int>(std::floor(xmin)), 0, static_cast<int>(width));
+		out_triangle.xto = std::clamp(static_cast<int>(std::ceil(xmax)), 0, static_cast<int>(width));
+		out_triangle.yfrom = std::clamp(static_cast<int>(std::floor(ymin)), 0, static_cast<int>(height));
+		out_triangle.yto = std::clamp(static_cast<int>(std::ceil(ymax)), 0, static_cast<int>(height));
+		if (out_triangle.xfrom >= out_triangle.xto || out_triangle.yfrom >= out_triangle.yto) {
+			return false;
+		}
+
+		out_triangle.face = face;
+		out_triangle.positions = {v0, v1, v2};
+		out_triangle.orientation = area_twice > 0.0f ? 1.0f : -1.0f;
+		out_triangle.inv_area_twice = 1.0f / (area_twice * out_triangle.orientation);
+		out_triangle.z_min = std::min({face[0].position.z, face[1].position.z, face[2].position.z});
+
+		// Gradients of every declared varying component, solved from its differences along the edges from v0
+		if constexpr (varyings::is_declared) {
+			const float2 e1 = v1 - v0;
+			const float2 e2 = v2 - v0;
+			const float inv_det = 1.0f / (e1.x * e2.y - e2.x * e1.y);
+			size_t plane_idx = 0;
+			for (const varying& attribute : SHADER::varyings) {
+				const float* a0 = get_component(out_triangle.face[0], attribute.offset);
+				const float* a1 = get_component(out_triangle.face[1], attribute.offset);
+				const float* a2 = get_component(out_triangle.face[2], attribute.offset);
+				for (size_t i = 0; i != attribute.count; ++i) {
+					const float d1 = a1[i] - a0[i];
+					const float d2 = a2[i] - a0[i];
+					out_triangle.varying_planes[plane_idx++] = {
+							(d1 * e2.y - d2 * e1.y) * inv_det,
+							(d2 * e1.x - d1 * e2.x) * inv_det,
+							a0[i]};
+				}
+			}
+		}
+		return true;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::rasterize_triangle(const triangle& tri, const utils::tile& tile, bool use_hi_z)
+	{
+		const int xfrom = std::max(tri.xfrom, static_cast<int>(tile.x_begin));
+		const int xto = std::min(tri.xto, static_cast<int>(tile.x_end));
+		const int yfrom = std::max(tri.yfrom, static_cast<int>(tile.y_begin));
+		const int yto = std::min(tri.yto, static_cast<int>(tile.y_end));
+		if (xfrom >= xto || yfrom >= yto) {
+			return;
+		}
 
-					auto is_inside_triangle = [](float3 bc) { return abs(bc[0] + bc[1] + bc[2] - 1) < 0.00001; };
+		// Edge equations E(x, y) = A * x + B * y + C for edges opposite to every vertex,
+		// so that E / area is the barycentric coordinate of that vertex.
+		// They are evaluated once at the first pixel center and then stepped by A and B
+		const auto& [v0, v1, v2] = tri.positions;
+		const std::array<std::pair<float2, float2>, 3> edges{{{v1, v2}, {v2, v0}, {v0, v1}}};
+		const float2 first_pixel{static_cast<float>(xfrom) + 0.5f, static_cast<float>(yfrom) + 0.5f};
+		std::array<float, 3> step_x, step_y, row_start;
+		std::array<bool, 3> is_top_left;
+		for (size_t i = 0; i != 3; ++i) {
+			const auto& [a, b] = edges[i];
+			step_x[i] = tri.orientation * (b.y - a.y);
+			step_y[i] = tri.orientation * (a.x - b.x);
+			row_start[i] = tri.orientation * edge_function(a, b, first_pixel);
+			// Top-left fill rule: pixels exactly on an edge belong to the triangle only
+			// if it is a left edge or a horizontal top one, so shared edges are drawn once
+			is_top_left[i] = step_x[i] > 0.0f || (step_x[i] == 0.0f && step_y[i] > 0.0f);
+		}
+		auto is_inside_edge = [&is_top_left](float e, size_t i) { return e > 0.0f || (e == 0.0f && is_top_left[i]); };
+
+		// Pixels are walked block by block of Hi-Z, so blocks hiding the triangle are skipped as a whole.
+		// Edge values are evaluated at the first pixel of every block row and offset by pixel inside it,
+		// the same way in the scalar loop and in vector lanes, so both give identical coverage
+		const auto& face = tri.face;
+		// Undeclared attributes are never written, so they stay the ones of the first vertex
+		VB pixel_data = face[0];
+#ifdef RASTERIZER_AVX2
+		// Rows of blocks are exactly one vector wide, late depth test needs the scalar loop
+		const bool use_avx2 = hi_z_tile == 8 && early_depth_test && depth_buffer && cpu_has_avx2();
+#endif
+		const int block = static_cast<int>(hi_z_tile);
+		for (int block_y = yfrom - yfrom % block; block_y < yto; block_y += block) {
+			const int y_begin = std::max(block_y, yfrom);
+			const int y_end = std::min(block_y + block, yto);
+			for (int block_x = xfrom - xfrom % block; block_x < xto; block_x += block) {
+				const size_t hi_z_idx = (block_y / block) * hi_z_stride + block_x / block;
+				if (use_hi_z && hi_z[hi_z_idx] <= tri.z_min) {
+					continue;
+				}
 
-					vertex pixel_data{};
-					// Render front faces
-					if (is_inside_triangle({u, v, w})) {
-						pixel_data = face[0] * u + face[1] * v + face[2] * w;
+				const int x_begin = std::max(block_x, xfrom);
+				const int x_end = std::min(block_x + block, xto);
+				bool is_depth_written = false;
+				std::array<float, 3> block_start;
+				for (size_t i = 0; i != 3; ++i) {
+					block_start[i] = row_start[i] + step_x[i] * static_cast<float>(x_begin - xfrom) +
+									 step_y[i] * static_cast<float>(y_begin - yfrom);
+				}
+				for (int y = y_begin; y < y_end; ++y) {
+#ifdef RASTERIZER_AVX2
+					if (use_avx2) {
+						is_depth_written |= rasterize_span_avx2(tri, pixel_data, block_start, step_x, is_top_left, x_begin, x_end, y);
+						for (size_t i = 0; i != 3; ++i) {
+							block_start[i] += step_y[i];
+						}
+						continue;
 					}
-					// Render back faces also
-					else if (is_inside_triangle({-u, -v, -w})) {
-						pixel_data = face[0] * -u + face[1] * -v + face[2] * -w;
+#endif
+					for (int x = x_begin; x < x_end; ++x) {
+						std::array<float, 3> e;
+						for (size_t i = 0; i != 3; ++i) {
+							e[i] = block_start[i] + step_x[i] * static_cast<float>(x - x_begin);
+						}
+						if (is_inside_edge(e[0], 0) && is_inside_edge(e[1], 1) && is_inside_edge(e[2], 2)) {
+							// Calculate pixel baricentric coordinates
+							const float u = e[0] * tri.inv_area_twice;
+							const float v = e[1] * tri.inv_area_twice;
+							const float w = e[2] * tri.inv_area_twice;
+
+							// Depth is interpolated alone, the rest of attributes only for pixels passing early depth test
+							const float z = face[0].position.z * u + face[1].position.z * v + face[2].position.z * w;
+							if (!early_depth_test || depth_test(z, x, y)) {
+								interpolate(tri, pixel_data, x, y, u, v, w);
+
+								// PS STAGE: Execute pixel shader, it may replace depth of the pixel
+								float pixel_z = z;
+								const color pixel_value = this->pixel_shader(pixel_data, u * u + v * v + w * w, pixel_z);
+
+								// Late depth test takes depth from the shader, early one has already tested the interpolated one
+								if (early_depth_test || depth_test(pixel_z, x, y)) {
+									depth_buffer->item(x, y) = early_depth_test ? z : pixel_z;
+									is_depth_written = true;
+									render_target->item(x, y) = unsigned_color::from_color(pixel_value);
+								}
+							}
+						}
 					}
-					else {
-						continue;
+					for (size_t i = 0; i != 3; ++i) {
+						block_start[i] += step_y[i];
 					}
+				}
+
+				if (use_hi_z && is_depth_written) {
+					update_hi_z(block_x / block, block_y / block);
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::interpolate(const triangle& tri, VB& pixel_data, int x, int y,
+														 float u, float v, float w) const
+	{
+		if constexpr (varyings::is_declared) {
+			const float dx = static_cast<float>(x) + 0.5f - tri.positions[0].x;
+			const float dy = static_cast<float>(y) + 0.5f - tri.positions[0].y;
+			size_t plane_idx = 0;
+			for (const varying& attribute : SHADER::varyings) {
+				float* component = get_component(pixel_data, attribute.offset);
+				for (size_t i = 0; i != attribute.count; ++i) {
+					const float3& plane = tri.varying_planes[plane_idx++];
+					component[i] = plane.z + plane.x * dx + plane.y * dy;
+				}
+			}
+		}
+		else {
+			pixel_data = tri.face[0] * u + tri.face[1] * v + tri.face[2] * w;
+		}
+	}
 
-					// Depth test
-					if (depth_test(pixel_data.position.z, x, y)) {
-						// Update depth buffer
-						float& depth = depth_buffer->item(x, y);
-						depth = pixel_data.position.z;
+#ifdef RASTERIZER_AVX2
+	template<typename VB, typename RT, typename SHADER>
+	RASTERIZER_TARGET_AVX2 inline bool rasterizer<VB, RT, SHADER>::rasterize_span_avx2(
+			const triangle& tri, VB& pixel_data, const std::array<float, 3>& row, const std::array<float, 3>& step_x,
+			const std::array<bool, 3>& is_top_left, int x_begin, int x_end, int y)
+	{
+		const __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+		const __m256 zero = _mm256_setzero_ps();
+
+		// Lanes past the end of the span are masked out from the start
+		__m256 covered = _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+				_mm256_set1_epi32(x_end - x_begin), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+		__m256 e[3];
+		for (size_t i = 0; i != 3; ++i) {
+			// Multiply and add are kept separate to round exactly as the scalar loop
+			e[i] = _mm256_add_ps(_mm256_set1_ps(row[i]), _mm256_mul_ps(_mm256_set1_ps(step_x[i]), lanes));
+			__m256 inside = _mm256_cmp_ps(e[i], zero, _CMP_GT_OQ);
+			if (is_top_left[i]) {
+				inside = _mm256_or_ps(inside, _mm256_cmp_ps(e[i], zero, _CMP_EQ_OQ));
+			}
+			covered = _mm256_and_ps(covered, inside);
+		}
+		if (_mm256_movemask_ps(covered) == 0) {
+			return false;
+		}
 
-						// PS STAGE: Execute pixel shader
-						color pixel_value = pixel_shader(pixel_data, u * u + v * v + w * w, depth);
-						render_target->item(x, y) = unsigned_color::from_color(pixel_value);
-					}					
+		const __m256 inv_area_twice = _mm256_set1_ps(tri.inv_area_twice);
+		const __m256 u = _mm256_mul_ps(e[0], inv_area_twice);
+		const __m256 v = _mm256_mul_ps(e[1], inv_area_twice);
+		const __m256 w = _mm256_mul_ps(e[2], inv_area_twice);
+		const __m256 z = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(tri.face[0].position.z), u),
+							  _mm256_mul_ps(_mm256_set1_ps(tri.face[1].position.z), v)),
+				_mm256_mul_ps(_mm256_set1_ps(tri.face[2].position.z), w));
+
+		// Masked load never touches pixels outside of the span, so the row end is safe to cross
+		float* depth_row = &depth_buffer->item(x_begin, y);
+		const __m256 depth = _mm256_maskload_ps(depth_row, _mm256_castps_si256(covered));
+		const __m256 passed = _mm256_and_ps(covered, _mm256_cmp_ps(z, depth, _CMP_LT_OQ));
+		const int mask = _mm256_movemask_ps(passed);
+		if (mask == 0) {
+			return false;
+		}
+		_mm256_maskstore_ps(depth_row, _mm256_castps_si256(passed), z);
+
+		// PS STAGE: Shaders are scalar, so passing pixels are shaded lane by lane.
+		// Depth is already tested and written, so the one returned by the shader is dropped
+		alignas(32) std::array<float, 8> u_lanes, v_lanes, w_lanes, z_lanes;
+		_mm256_store_ps(u_lanes.data(), u);
+		_mm256_store_ps(v_lanes.data(), v);
+		_mm256_store_ps(w_lanes.data(), w);
+		_mm256_store_ps(z_lanes.data(), z);
+		for (int lane = 0; lane != 8; ++lane) {
+			if (mask & (1 << lane)) {
+				const int x = x_begin + lane;
+				interpolate(tri, pixel_data, x, y, u_lanes[lane], v_lanes[lane], w_lanes[lane]);
+				const float b = u_lanes[lane] * u_lanes[lane] + v_lanes[lane] * v_lanes[lane] + w_lanes[lane] * w_lanes[lane];
+				const color pixel_value = this->pixel_shader(pixel_data, b, z_lanes[lane]);
+				render_target->item(x, y) = unsigned_color::from_color(pixel_value);
+			}
+		}
+		return true;
+	}
+#endif
+
+	template<typename VB, typename RT, typename SHADER>
+	inline bool rasterizer<VB, RT, SHADER>::is_occluded(const triangle& tri, const utils::tile& tile) const
+	{
+		const size_t xfrom = std::max(static_cast<size_t>(tri.xfrom), tile.x_begin);
+		const size_t xto = std::min(static_cast<size_t>(tri.xto), tile.x_end);
+		const size_t yfrom = std::max(static_cast<size_t>(tri.yfrom), tile.y_begin);
+		const size_t yto = std::min(static_cast<size_t>(tri.yto), tile.y_end);
+		if (xfrom >= xto || yfrom >= yto) {
+			return true;
+		}
+		for (size_t block_y = yfrom / hi_z_tile; block_y <= (yto - 1) / hi_z_tile; ++block_y) {
+			for (size_t block_x = xfrom / hi_z_tile; block_x <= (xto - 1) / hi_z_tile; ++block_x) {
+				if (hi_z[block_y * hi_z_stride + block_x] > tri.z_min) {
+					return false;
 				}
 			}
 		}
+		return true;
+	}
+
+	template<typename VB, typename RT, typename SHADER>
+	inline void rasterizer<VB, RT, SHADER>::update_hi_z(size_t block_x, size_t block_y)
+	{
+		const size_t x_end = std::min((block_x + 1) * hi_z_tile, width);
+		const size_t y_end = std::min((block_y + 1) * hi_z_tile, height);
+		float farthest = -FLT_MAX;
+		for (size_t y = block_y * hi_z_tile; y != y_end; ++y) {
+			for (size_t x = block_x * hi_z_tile; x != x_end; ++x) {
+				farthest = std::max(farthest, depth_buffer->item(x, y));
+			}
+		}
+		hi_z[block_y * hi_z_stride + block_x] = farthest;
 	}
 
-	template<typename VB, typename RT>
+	template<typename VB, typename RT, typename SHADER>
 	inline float
-	rasterizer<VB, RT>::edge_function(float2 a, float2 b, float2 c)
+	rasterizer<VB, RT, SHADER>::edge_function(float2 a, float2 b, float2 c) const
 	{
-		THROW_ERROR("Not implemented yet");
+		// Twice the signed area of triangle abc, positive when c is on the right of ab
+		// in y-up axes, i.e. on the left of ab on screen where y goes down
+		return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
 	}
 
-	template<typename VB, typename RT>
-	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+	template<typename VB, typename RT, typename SHADER>
+	inline bool rasterizer<VB, RT, SHADER>::depth_test(float z, size_t x, size_t y)
 	{
 		// Depth buffer stores inverse value of depth for better precision
 		// Hence, depth test operation is inverted
@@ -14,9 +14,10 @@ void cg::renderer::rasterization_renderer::init()
 	depth_buffer = std::make_shared<resource<float>>(get_width(), get_height());
 
 	// Create rasterizer instance
-	rasterizer = std::make_shared<cg::renderer::rasterizer<vertex, unsigned_color>>();
+	rasterizer = std::make_shared<cg::renderer::rasterizer<vertex, unsigned_color, barycentric_shader>>();
 	rasterizer->set_render_target(render_target, depth_buffer);
 	rasterizer->set_viewport(get_width(), get_height());
+	rasterizer->set_scheduler(std::make_shared<utils::tile_scheduler>(settings->num_threads, settings->tile_size));
 
 	// Setup camera settings
 	const DirectX::XMFLOAT3 camera_position{
@@ -39,33 +40,9 @@ void cg::renderer::rasterization_renderer::init()
 	model = std::make_shared<cg::world::model>();
 	model->load_obj(settings->model_path);
 
-	// Add vertex shader
-	rasterizer->vertex_shader = [this](vertex vertex_data) {
-		// Collect transformation matrices
-		const DirectX::XMMATRIX world = (model->get_world_matrix());
-		const DirectX::XMMATRIX view = (camera->get_view_matrix());
-		const DirectX::XMMATRIX projection = (camera->get_projection_matrix());
-
-		DirectX::XMVECTOR address = DirectX::XMLoadFloat3(&vertex_data.position);
-
-		address = DirectX::XMVector3Project(address, 0.0f, 0.0f,
-											static_cast<float>(settings->width),
-											static_cast<float>(settings->height),
-											settings->camera_z_near,
-											settings->camera_z_far,
-											projection, view, world);
-
-		DirectX::XMStoreFloat3(&vertex_data.position, address);
-		return vertex_data;
-	};
-
-	rasterizer->pixel_shader = [this](vertex vertex_data, const float b, const float z) {
-		const float distance = 0.25f + 0.75f * 5000 * z;
-		const float intensity = (1 - b);
-		// Pixel shader renders pixels according to its depth and barycentric distance
-		// from vertices. This way, vertices have black color and face centers have white.
-		return color::from_float3(float3{intensity, intensity, intensity});
-	};
+	// Vertices are transformed by the rasterizer using per-draw constants,
+	// depth is mapped into the camera range to keep the pixel shader scale
+	rasterizer->set_depth_range(settings->camera_z_near, settings->camera_z_far);
 }
 
 void cg::renderer::rasterization_renderer::destroy() {}
@@ -82,6 +59,9 @@ void cg::renderer::rasterization_renderer::render()
 
 	const size_t num_shapes = vertex_buffers.size();
 
+	// Matrices are the same for every shape
+	rasterizer->set_transform(model->get_world_matrix(), camera->get_view_matrix(), camera->get_projection_matrix());
+
 	// Render every shape
 	for (size_t i = 0; i != num_shapes; ++i) {
 		rasterizer->set_vertex_buffer(vertex_buffers[i]);
@@ -5,6 +5,26 @@
 
 namespace cg::renderer
 {
+	// Shaders of the renderer bound to the rasterizer at compile time
+	struct barycentric_shader
+	{
+		// Pixel shader reads no vertex attributes
+		static constexpr std::array<varying, 0> varyings{};
+
+		vertex vertex_shader(const vertex& vertex_data) const
+		{
+			return vertex_data;
+		}
+
+		// Pixel shader renders pixels according to its depth and barycentric distance
+		// from vertices. This way, vertices have black color and face centers have white.
+		color pixel_shader(const vertex& vertex_data, const float b, float& z) const
+		{
+			const float intensity = (1 - b);
+			return color::from_float3(float3{intensity, intensity, intensity});
+		}
+	};
+
 	class rasterization_renderer : public renderer
 	{
 	public:
@@ -18,6 +38,6 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
 
-		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color, barycentric_shader>> rasterizer;
 	};
 }// namespace cg::renderer
\ No newline at end of file
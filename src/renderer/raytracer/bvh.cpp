@@ -0,0 +1,339 @@
+#include "bvh.h"
+
+#include "utils/error_handler.h"
+
+#include <array>
+#include <cstring>
+#include <fstream>
+
+using namespace DirectX;
+
+void cg::renderer::aabb::extend(FXMVECTOR point)
+{
+	XMStoreFloat3(&lower, XMVectorMin(XMLoadFloat3(&lower), point));
+	XMStoreFloat3(&upper, XMVectorMax(XMLoadFloat3(&upper), point));
+}
+
+void cg::renderer::aabb::extend(const aabb& other)
+{
+	XMStoreFloat3(&lower, XMVectorMin(XMLoadFloat3(&lower), XMLoadFloat3(&other.lower)));
+	XMStoreFloat3(&upper, XMVectorMax(XMLoadFloat3(&upper), XMLoadFloat3(&other.upper)));
+}
+
+XMVECTOR cg::renderer::aabb::get_center() const
+{
+	return XMVectorScale(XMVectorAdd(XMLoadFloat3(&lower), XMLoadFloat3(&upper)), 0.5f);
+}
+
+float cg::renderer::aabb::surface_area() const
+{
+	const float dx = upper.x - lower.x;
+	const float dy = upper.y - lower.y;
+	const float dz = upper.z - lower.z;
+	// Empty boxes have inverted bounds
+	if (dx < 0.0f || dy < 0.0f || dz < 0.0f)
+	{
+		return 0.0f;
+	}
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+namespace
+{
+	// Cache file is the header followed by the node and primitive arrays as they are in memory
+	struct bvh_file_header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint64_t num_nodes;
+		uint64_t num_primitives;
+	};
+
+	constexpr char bvh_file_magic[4] = {'B', 'V', 'H', '2'};
+}
+
+bool cg::renderer::bvh::load(const std::filesystem::path& path, uint64_t key)
+{
+	if (!std::filesystem::exists(path))
+	{
+		return false;
+	}
+
+	auto file = std::make_shared<utils::mapped_file>(path);
+	if (file->get_size() < sizeof(bvh_file_header))
+	{
+		return false;
+	}
+
+	bvh_file_header header;
+	std::memcpy(&header, file->get_data(), sizeof(header));
+	if (std::memcmp(header.magic, bvh_file_magic, sizeof(header.magic)) != 0 ||
+		header.version != file_version || header.key != key)
+	{
+		return false;
+	}
+	// Counts are bounded by the file size first, so the expected size can't overflow
+	const size_t payload_size = file->get_size() - sizeof(header);
+	if (header.num_nodes > payload_size / sizeof(bvh_node) ||
+		header.num_primitives > payload_size / sizeof(bvh_primitive))
+	{
+		return false;
+	}
+	const size_t expected_size = sizeof(header) +
+								 header.num_nodes * sizeof(bvh_node) +
+								 header.num_primitives * sizeof(bvh_primitive);
+	if (file->get_size() != expected_size)
+	{
+		return false;
+	}
+
+	// Header keeps the arrays 8-byte aligned inside the page aligned mapping
+	const auto* loaded_nodes = reinterpret_cast<const bvh_node*>(file->get_data() + sizeof(header));
+	if (!validate_nodes(loaded_nodes, static_cast<size_t>(header.num_nodes), static_cast<size_t>(header.num_primitives)))
+	{
+		return false;
+	}
+
+	nodes.clear();
+	primitives.clear();
+	mapping = file;
+	node_data = loaded_nodes;
+	num_nodes = static_cast<size_t>(header.num_nodes);
+	primitive_data = reinterpret_cast<const bvh_primitive*>(node_data + num_nodes);
+	num_primitives = static_cast<size_t>(header.num_primitives);
+	return true;
+}
+
+bool cg::renderer::bvh::validate_nodes(const bvh_node* in_nodes, size_t in_num_nodes, size_t in_num_primitives)
+{
+	if (in_num_nodes == 0)
+	{
+		return in_num_primitives == 0;
+	}
+
+	// Children are always stored after their parent, so depths are known before the children are reached
+	std::vector<size_t> depths(in_num_nodes, 0);
+	depths[0] = 1;
+	for (size_t i = 0; i != in_num_nodes; ++i)
+	{
+		const bvh_node& node = in_nodes[i];
+		if (depths[i] == 0)
+		{
+			return false;// not referenced by any parent
+		}
+		if (node.is_leaf())
+		{
+			if (static_cast<uint64_t>(node.left_first) + node.primitive_count > in_num_primitives)
+			{
+				return false;
+			}
+			continue;
+		}
+		// Traversal stacks hold one entry per level plus the sibling
+		if (node.left_first <= i || static_cast<uint64_t>(node.left_first) + 1 >= in_num_nodes ||
+			depths[i] + 2 >= max_depth)
+		{
+			return false;
+		}
+		depths[node.left_first] = depths[i] + 1;
+		depths[node.left_first + 1] = depths[i] + 1;
+	}
+	return true;
+}
+
+void cg::renderer::bvh::save(const std::filesystem::path& path, uint64_t key) const
+{
+	bvh_file_header header;
+	std::memcpy(header.magic, bvh_file_magic, sizeof(header.magic));
+	header.version = file_version;
+	header.key = key;
+	header.num_nodes = num_nodes;
+	header.num_primitives = num_primitives;
+
+	// Write into a file of this job only, the complete one is renamed into place
+	const std::filesystem::path temp_path = utils::get_temp_path(path);
+	{
+		std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(node_data), num_nodes * sizeof(bvh_node));
+		file.write(reinterpret_cast<const char*>(primitive_data), num_primitives * sizeof(bvh_primitive));
+		if (!file)
+		{
+			file.close();
+			std::filesystem::remove(temp_path);
+			THROW_ERROR("Can't write " + temp_path.string());
+		}
+	}
+	std::filesystem::rename(temp_path, path);
+}
+
+void cg::renderer::bvh::build_hierarchy(std::vector<aabb>& primitive_bounds)
+{
+	nodes.clear();
+	node_data = nullptr;
+	num_nodes = 0;
+	primitive_data = primitives.data();
+	num_primitives = primitives.size();
+	if (primitives.empty())
+	{
+		return;
+	}
+
+	std::vector<XMFLOAT3> centroids(primitive_bounds.size());
+	for (size_t i = 0; i != primitive_bounds.size(); ++i)
+	{
+		XMStoreFloat3(&centroids[i], primitive_bounds[i].get_center());
+	}
+
+	// Binary tree with N leaves has no more than 2N - 1 nodes
+	nodes.reserve(2 * primitives.size());
+	nodes.push_back({});
+	nodes[0].left_first = 0;
+	nodes[0].primitive_count = static_cast<unsigned>(primitives.size());
+	update_bounds(0, primitive_bounds);
+
+	subdivide(0, 1, primitive_bounds, centroids);
+
+	node_data = nodes.data();
+	num_nodes = nodes.size();
+}
+
+void cg::renderer::bvh::update_bounds(unsigned node_idx, const std::vector<aabb>& primitive_bounds)
+{
+	bvh_node& node = nodes[node_idx];
+	aabb bounds;
+	for (unsigned i = 0; i != node.primitive_count; ++i)
+	{
+		bounds.extend(primitive_bounds[node.left_first + i]);
+	}
+	node.aabb_min = bounds.lower;
+	node.aabb_max = bounds.upper;
+}
+
+void cg::renderer::bvh::subdivide(unsigned node_idx, size_t depth,
+								  std::vector<aabb>& primitive_bounds, std::vector<XMFLOAT3>& centroids)
+{
+	constexpr size_t num_bins = 16;
+
+	const unsigned first = nodes[node_idx].left_first;
+	const unsigned count = nodes[node_idx].primitive_count;
+
+	// Every level takes one slot of the traversal stack plus one for the sibling
+	if (count <= 1 || depth + 2 >= max_depth)
+	{
+		return;
+	}
+
+	aabb centroidBounds;
+	for (unsigned i = first; i != first + count; ++i)
+	{
+		centroidBounds.extend(XMLoadFloat3(&centroids[i]));
+	}
+
+	// Evaluate SAH cost of splitting at every bin boundary of every axis
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	float bestSplit = 0.0f;
+	for (int axis = 0; axis != 3; ++axis)
+	{
+		const float boundsMin = (&centroidBounds.lower.x)[axis];
+		const float boundsMax = (&centroidBounds.upper.x)[axis];
+		if (boundsMin == boundsMax)
+		{
+			continue;
+		}
+
+		std::array<aabb, num_bins> bins;
+		std::array<unsigned, num_bins> binCounts{};
+		const float scale = num_bins / (boundsMax - boundsMin);
+		for (unsigned i = first; i != first + count; ++i)
+		{
+			const float c = (&centroids[i].x)[axis];
+			const size_t binIdx = std::min(num_bins - 1, static_cast<size_t>((c - boundsMin) * scale));
+			bins[binIdx].extend(primitive_bounds[i]);
+			++binCounts[binIdx];
+		}
+
+		// Sweep from both sides to accumulate areas and counts of the two halves
+		std::array<float, num_bins - 1> leftArea, rightArea;
+		std::array<unsigned, num_bins - 1> leftCount, rightCount;
+		aabb leftBox, rightBox;
+		unsigned leftSum = 0, rightSum = 0;
+		for (size_t i = 0; i != num_bins - 1; ++i)
+		{
+			leftSum += binCounts[i];
+			leftCount[i] = leftSum;
+			leftBox.extend(bins[i]);
+			leftArea[i] = leftBox.surface_area();
+
+			rightSum += binCounts[num_bins - 1 - i];
+			rightCount[num_bins - 2 - i] = rightSum;
+			rightBox.extend(bins[num_bins - 1 - i]);
+			rightArea[num_bins - 2 - i] = rightBox.surface_area();
+		}
+
+		for (size_t i = 0; i != num_bins - 1; ++i)
+		{
+			const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (leftCount[i] != 0 && rightCount[i] != 0 && cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = boundsMin + (i + 1) / scale;
+			}
+		}
+	}
+
+	// Keep the leaf if splitting is not cheaper than intersecting all of its triangles
+	const aabb nodeBounds{nodes[node_idx].aabb_min, nodes[node_idx].aabb_max};
+	if (bestAxis == -1 || bestCost >= count * nodeBounds.surface_area())
+	{
+		return;
+	}
+
+	// Partition primitives in place around the split plane
+	unsigned i = first;
+	unsigned j = first + count - 1;
+	while (i <= j)
+	{
+		if ((&centroids[i].x)[bestAxis] < bestSplit)
+		{
+			++i;
+		}
+		else
+		{
+			std::swap(primitives[i], primitives[j]);
+			std::swap(primitive_bounds[i], primitive_bounds[j]);
+			std::swap(centroids[i], centroids[j]);
+			if (j == 0)
+			{
+				break;
+			}
+			--j;
+		}
+	}
+
+	const unsigned leftCount = i - first;
+	if (leftCount == 0 || leftCount == count)
+	{
+		return;
+	}
+
+	// Siblings are allocated next to each other
+	const unsigned leftIdx = static_cast<unsigned>(nodes.size());
+	nodes.push_back({});
+	nodes.push_back({});
+	nodes[leftIdx].left_first = first;
+	nodes[leftIdx].primitive_count = leftCount;
+	nodes[leftIdx + 1].left_first = i;
+	nodes[leftIdx + 1].primitive_count = count - leftCount;
+	nodes[node_idx].left_first = leftIdx;
+	nodes[node_idx].primitive_count = 0;
+
+	update_bounds(leftIdx, primitive_bounds);
+	update_bounds(leftIdx + 1, primitive_bounds);
+
+	subdivide(leftIdx, depth + 1, primitive_bounds, centroids);
+	subdivide(leftIdx + 1, depth + 1, primitive_bounds, centroids);
+}
@@ -0,0 +1,487 @@
+#pragma once
+
+#include "render_stats.h"
+#include "resource.h"
+#include "utils/mapped_file.h"
+
+#include "DirectXMath.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+namespace cg::renderer
+{
+	// Axis aligned bounding box used to build the hierarchy
+	struct aabb
+	{
+		DirectX::XMFLOAT3 lower{FLT_MAX, FLT_MAX, FLT_MAX};
+		DirectX::XMFLOAT3 upper{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+		void extend(DirectX::FXMVECTOR point);
+		void extend(const aabb& other);
+
+		DirectX::XMVECTOR get_center() const;
+		float surface_area() const;
+	};
+
+
+	// Node of the binary hierarchy. It is 32 bytes, so two siblings share one cache line
+	struct bvh_node
+	{
+		DirectX::XMFLOAT3 aabb_min;
+		unsigned left_first; // left child for inner nodes, first primitive for leaves
+		DirectX::XMFLOAT3 aabb_max;
+		unsigned primitive_count; // 0 for inner nodes, right child is stored at left_first + 1
+
+		bool is_leaf() const { return primitive_count != 0; }
+	};
+
+
+	// Reference to a triangle of one of the shapes
+	struct bvh_primitive
+	{
+		unsigned shape_id;
+		unsigned primitive_id;
+	};
+
+
+	// Triangle prepared for intersection tests. Records are stored in the order of hierarchy primitives,
+	// so triangles of one leaf are next to each other. 64 bytes, one cache line per record
+	struct triangle_record
+	{
+		DirectX::XMFLOAT3 v0;
+		unsigned shape_id;
+		DirectX::XMFLOAT3 edge1; // v1 - v0
+		unsigned primitive_id;
+		DirectX::XMFLOAT3 edge2; // v2 - v0
+		float padding0;
+		DirectX::XMFLOAT3 normal; // geometric normal used for lighting
+		float padding1;
+	};
+
+
+	// Rays traced together in SIMD lanes, a single ray is replicated into every lane
+	struct ray_packet
+	{
+		DirectX::XMVECTOR origin_x, origin_y, origin_z;
+		DirectX::XMVECTOR direction_x, direction_y, direction_z;
+		DirectX::XMVECTOR inv_direction_x, inv_direction_y, inv_direction_z;
+
+		static ray_packet from_ray(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction);
+		static ray_packet from_rays(const DirectX::XMVECTOR (&origins)[4], const DirectX::XMVECTOR (&directions)[4]);
+	};
+
+
+	// Triangles in SIMD lanes, a single triangle is replicated into every lane
+	struct triangle_lanes
+	{
+		DirectX::XMVECTOR v0_x, v0_y, v0_z;
+		DirectX::XMVECTOR edge1_x, edge1_y, edge1_z;
+		DirectX::XMVECTOR edge2_x, edge2_y, edge2_z;
+
+		static triangle_lanes from_record(const triangle_record& triangle);
+	};
+
+
+	// Bit i is set when lane i of the comparison result is true
+	int get_lane_mask(DirectX::FXMVECTOR mask);
+
+	// Moller-Trumbore test of every lane, returns mask of lanes hit within [min_t, max_t].
+	// u and v are barycentric coordinates of vertices 1 and 2
+	int intersect_triangle_lanes(const ray_packet& ray, const triangle_lanes& triangle,
+								 DirectX::FXMVECTOR min_t, DirectX::FXMVECTOR max_t,
+								 DirectX::XMVECTOR& t, DirectX::XMVECTOR& u, DirectX::XMVECTOR& v);
+
+
+	// Bounding volume hierarchy over all triangles of the scene built with binned SAH
+	class bvh
+	{
+	public:
+		template<typename VB>
+		void build(const std::vector<std::shared_ptr<resource<VB>>>& vertex_buffers,
+				   const std::vector<std::shared_ptr<resource<unsigned int>>>& index_buffers);
+
+		// Visit leaves hit by the ray from the nearest to the farthest one.
+		// intersect_primitive(primitive_idx, max_t) gets index into get_primitives(),
+		// shrinks max_t on every closer hit and returns true to terminate the traversal
+		template<typename F>
+		void traverse(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction,
+					  float min_t, float& max_t, F&& intersect_primitive) const;
+
+		// Same traversal for four rays at once. Nodes are visited while at least one active ray hits them.
+		// intersect_primitive(primitive_idx, active_mask, max_t) shrinks max_t lanes on closer hits
+		template<typename F>
+		void traverse_packet(const ray_packet& packet, DirectX::FXMVECTOR min_t, DirectX::XMVECTOR& max_t,
+							 F&& intersect_primitive) const;
+
+		// Map hierarchy previously saved for the same key. Returns false if the file is missing,
+		// was written for another key or by another version of the format, or its nodes are malformed
+		bool load(const std::filesystem::path& path, uint64_t key);
+		void save(const std::filesystem::path& path, uint64_t key) const;
+
+		// Bounds of the whole scene
+		aabb get_bounds() const;
+
+		const bvh_node* get_nodes() const { return node_data; }
+		size_t get_num_nodes() const { return num_nodes; }
+		const bvh_primitive* get_primitives() const { return primitive_data; }
+		size_t get_num_primitives() const { return num_primitives; }
+
+		static bool intersect_box(const bvh_node& node, DirectX::FXMVECTOR origin, DirectX::FXMVECTOR inv_direction,
+								  float min_t, float max_t, float& entry_t);
+
+		static int intersect_box_packet(const bvh_node& node, const ray_packet& packet,
+										DirectX::FXMVECTOR min_t, DirectX::FXMVECTOR max_t, DirectX::XMVECTOR& entry_t);
+
+		static constexpr size_t max_depth = 64;
+		static constexpr uint32_t file_version = 1;
+
+	protected:
+		void build_hierarchy(std::vector<aabb>& primitive_bounds);
+		void subdivide(unsigned node_idx, size_t depth,
+					   std::vector<aabb>& primitive_bounds, std::vector<DirectX::XMFLOAT3>& centroids);
+		void update_bounds(unsigned node_idx, const std::vector<aabb>& primitive_bounds);
+
+		// Every node is reachable from the root, refers to existing children or primitives
+		// and is no deeper than traversal stacks allow
+		static bool validate_nodes(const bvh_node* in_nodes, size_t in_num_nodes, size_t in_num_primitives);
+
+		// Storage of a built hierarchy
+		std::vector<bvh_node> nodes;
+		std::vector<bvh_primitive> primitives;
+		// Storage of a loaded one, used in place without copying
+		std::shared_ptr<utils::mapped_file> mapping;
+
+		// Hierarchy used for traversal, points into one of the storages above
+		const bvh_node* node_data = nullptr;
+		size_t num_nodes = 0;
+		const bvh_primitive* primitive_data = nullptr;
+		size_t num_primitives = 0;
+	};
+
+
+	template<typename VB>
+	void bvh::build(const std::vector<std::shared_ptr<resource<VB>>>& vertex_buffers,
+					const std::vector<std::shared_ptr<resource<unsigned int>>>& index_buffers)
+	{
+		using namespace DirectX;
+		primitives.clear();
+		mapping.reset();
+		std::vector<aabb> primitive_bounds;
+
+		for (size_t shapeIdx = 0; shapeIdx != index_buffers.size(); ++shapeIdx)
+		{
+			const size_t numFaces = index_buffers[shapeIdx]->get_number_of_elements() / 3;
+			for (size_t faceIdx = 0; faceIdx != numFaces; ++faceIdx)
+			{
+				aabb bounds;
+				for (size_t i = 0; i != 3; ++i)
+				{
+					const unsigned index = index_buffers[shapeIdx]->item(3 * faceIdx + i);
+					bounds.extend(XMLoadFloat3(&vertex_buffers[shapeIdx]->item(index).position));
+				}
+				primitives.push_back({static_cast<unsigned>(shapeIdx), static_cast<unsigned>(faceIdx)});
+				primitive_bounds.push_back(bounds);
+			}
+		}
+
+		build_hierarchy(primitive_bounds);
+	}
+
+	template<typename F>
+	void bvh::traverse(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction,
+					   float min_t, float& max_t, F&& intersect_primitive) const
+	{
+		using namespace DirectX;
+		if (num_nodes == 0)
+		{
+			return;
+		}
+
+		struct stack_entry
+		{
+			unsigned node_idx;
+			float entry_t;
+		};
+		stack_entry stack[max_depth];
+		size_t stack_size = 0;
+		trace_counters& counters = thread_counters;
+
+		const XMVECTOR invDirection = XMVectorReciprocal(direction);
+		float entryT;
+		++counters.boxes_tested;
+		if (intersect_box(node_data[0], origin, invDirection, min_t, max_t, entryT))
+		{
+			stack[stack_size++] = {0, entryT};
+		}
+
+		while (stack_size != 0)
+		{
+			const stack_entry current = stack[--stack_size];
+			// Closer hit is already found, so the node can't contain anything better
+			if (current.entry_t > max_t)
+			{
+				continue;
+			}
+
+			const bvh_node& node = node_data[current.node_idx];
+			if (node.is_leaf())
+			{
+				for (unsigned i = 0; i != node.primitive_count; ++i)
+				{
+					++counters.triangles_tested;
+					if (intersect_primitive(node.left_first + i, max_t))
+					{
+						return;
+					}
+				}
+				continue;
+			}
+
+			const unsigned leftIdx = node.left_first;
+			const unsigned rightIdx = node.left_first + 1;
+			float leftT, rightT;
+			counters.boxes_tested += 2;
+			const bool bHitLeft = intersect_box(node_data[leftIdx], origin, invDirection, min_t, max_t, leftT);
+			const bool bHitRight = intersect_box(node_data[rightIdx], origin, invDirection, min_t, max_t, rightT);
+
+			// Push the far child first, so the near one is visited next
+			if (bHitLeft && bHitRight)
+			{
+				if (leftT <= rightT)
+				{
+					stack[stack_size++] = {rightIdx, rightT};
+					stack[stack_size++] = {leftIdx, leftT};
+				}
+				else
+				{
+					stack[stack_size++] = {leftIdx, leftT};
+					stack[stack_size++] = {rightIdx, rightT};
+				}
+			}
+			else if (bHitLeft)
+			{
+				stack[stack_size++] = {leftIdx, leftT};
+			}
+			else if (bHitRight)
+			{
+				stack[stack_size++] = {rightIdx, rightT};
+			}
+		}
+	}
+
+	template<typename F>
+	void bvh::traverse_packet(const ray_packet& packet, DirectX::FXMVECTOR min_t, DirectX::XMVECTOR& max_t,
+							  F&& intersect_primitive) const
+	{
+		using namespace DirectX;
+		if (num_nodes == 0)
+		{
+			return;
+		}
+
+		struct stack_entry
+		{
+			XMVECTOR entry_t;
+			unsigned node_idx;
+			int active_mask;
+		};
+		stack_entry stack[max_depth];
+		size_t stack_size = 0;
+		trace_counters& counters = thread_counters;
+
+		XMVECTOR entryT;
+		++counters.boxes_tested;
+		const int rootMask = intersect_box_packet(node_data[0], packet, min_t, max_t, entryT);
+		if (rootMask != 0)
+		{
+			stack[stack_size++] = {entryT, 0, rootMask};
+		}
+
+		while (stack_size != 0)
+		{
+			const stack_entry current = stack[--stack_size];
+			// Rays that have already found a closer hit leave the subtree
+			const int activeMask = current.active_mask & get_lane_mask(XMVectorLessOrEqual(current.entry_t, max_t));
+			if (activeMask == 0)
+			{
+				continue;
+			}
+
+			const bvh_node& node = node_data[current.node_idx];
+			if (node.is_leaf())
+			{
+				for (unsigned i = 0; i != node.primitive_count; ++i)
+				{
+					++counters.triangles_tested;
+					intersect_primitive(node.left_first + i, activeMask, max_t);
+				}
+				continue;
+			}
+
+			// Rays that missed the parent don't take part in its subtree
+			const unsigned leftIdx = node.left_first;
+			const unsigned rightIdx = node.left_first + 1;
+			XMVECTOR leftT, rightT;
+			counters.boxes_tested += 2;
+			const int leftMask = intersect_box_packet(node_data[leftIdx], packet, min_t, max_t, leftT) & activeMask;
+			const int rightMask = intersect_box_packet(node_data[rightIdx], packet, min_t, max_t, rightT) & activeMask;
+
+			// Coherent rays agree on the order, so any ray hitting both children decides which one is near
+			bool bLeftFirst = true;
+			if (const int bothMask = leftMask & rightMask; bothMask != 0)
+			{
+				size_t lane = 0;
+				while (!(bothMask & (1 << lane)))
+				{
+					++lane;
+				}
+				XMFLOAT4A left, right;
+				XMStoreFloat4A(&left, leftT);
+				XMStoreFloat4A(&right, rightT);
+				bLeftFirst = (&left.x)[lane] <= (&right.x)[lane];
+			}
+
+			// Push the far child first, so the near one is visited next
+			if (bLeftFirst)
+			{
+				if (rightMask != 0)
+				{
+					stack[stack_size++] = {rightT, rightIdx, rightMask};
+				}
+				if (leftMask != 0)
+				{
+					stack[stack_size++] = {leftT, leftIdx, leftMask};
+				}
+			}
+			else
+			{
+				stack[stack_size++] = {leftT, leftIdx, leftMask};
+				stack[stack_size++] = {rightT, rightIdx, rightMask};
+			}
+		}
+	}
+
+	inline int bvh::intersect_box_packet(const bvh_node& node, const ray_packet& packet,
+										 DirectX::FXMVECTOR min_t, DirectX::FXMVECTOR max_t, DirectX::XMVECTOR& entry_t)
+	{
+		using namespace DirectX;
+		// Slab test of the same box for every ray
+		const XMVECTOR tx0 = XMVectorMultiply(XMVectorSubtract(XMVectorReplicate(node.aabb_min.x), packet.origin_x), packet.inv_direction_x);
+		const XMVECTOR tx1 = XMVectorMultiply(XMVectorSubtract(XMVectorReplicate(node.aabb_max.x), packet.origin_x), packet.inv_direction_x);
+		const XMVECTOR ty0 = XMVectorMultiply(XMVectorSubtract(XMVectorReplicate(node.aabb_min.y), packet.origin_y), packet.inv_direction_y);
+		const XMVECTOR ty1 = XMVectorMultiply(XMVectorSubtract(XMVectorReplicate(node.aabb_max.y), packet.origin_y), packet.inv_direction_y);
+		const XMVECTOR tz0 = XMVectorMultiply(XMVectorSubtract(XMVectorReplicate(node.aabb_min.z), packet.origin_z), packet.inv_direction_z);
+		const XMVECTOR tz1 = XMVectorMultiply(XMVectorSubtract(XMVectorReplicate(node.aabb_max.z), packet.origin_z), packet.inv_direction_z);
+		entry_t = XMVectorMax(XMVectorMax(XMVectorMin(tx0, tx1), XMVectorMin(ty0, ty1)),
+							  XMVectorMax(XMVectorMin(tz0, tz1), min_t));
+		const XMVECTOR exitT = XMVectorMin(XMVectorMin(XMVectorMax(tx0, tx1), XMVectorMax(ty0, ty1)),
+										   XMVectorMin(XMVectorMax(tz0, tz1), max_t));
+		return get_lane_mask(XMVectorLessOrEqual(entry_t, exitT));
+	}
+
+	inline aabb bvh::get_bounds() const
+	{
+		return num_nodes == 0 ? aabb{} : aabb{node_data[0].aabb_min, node_data[0].aabb_max};
+	}
+
+	inline bool bvh::intersect_box(const bvh_node& node, DirectX::FXMVECTOR origin, DirectX::FXMVECTOR inv_direction,
+								   float min_t, float max_t, float& entry_t)
+	{
+		using namespace DirectX;
+		// Slab test: distances to the pair of planes along each axis
+		const XMVECTOR t0 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat3(&node.aabb_min), origin), inv_direction);
+		const XMVECTOR t1 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat3(&node.aabb_max), origin), inv_direction);
+		const XMVECTOR tNear = XMVectorMin(t0, t1);
+		const XMVECTOR tFar = XMVectorMax(t0, t1);
+
+		entry_t = std::max({XMVectorGetX(tNear), XMVectorGetY(tNear), XMVectorGetZ(tNear), min_t});
+		const float exitT = std::min({XMVectorGetX(tFar), XMVectorGetY(tFar), XMVectorGetZ(tFar), max_t});
+		return entry_t <= exitT;
+	}
+
+	inline ray_packet ray_packet::from_ray(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction)
+	{
+		using namespace DirectX;
+		const XMVECTOR invDirection = XMVectorReciprocal(direction);
+		return {
+				XMVectorSplatX(origin), XMVectorSplatY(origin), XMVectorSplatZ(origin),
+				XMVectorSplatX(direction), XMVectorSplatY(direction), XMVectorSplatZ(direction),
+				XMVectorSplatX(invDirection), XMVectorSplatY(invDirection), XMVectorSplatZ(invDirection)};
+	}
+
+	inline ray_packet ray_packet::from_rays(const DirectX::XMVECTOR (&origins)[4], const DirectX::XMVECTOR (&directions)[4])
+	{
+		using namespace DirectX;
+		// Transpose rays into lanes, the 4th row is not used
+		const XMMATRIX origin = XMMatrixTranspose(XMMATRIX(origins[0], origins[1], origins[2], origins[3]));
+		const XMMATRIX direction = XMMatrixTranspose(XMMATRIX(directions[0], directions[1], directions[2], directions[3]));
+		return {
+				origin.r[0], origin.r[1], origin.r[2],
+				direction.r[0], direction.r[1], direction.r[2],
+				XMVectorReciprocal(direction.r[0]), XMVectorReciprocal(direction.r[1]), XMVectorReciprocal(direction.r[2])};
+	}
+
+	inline triangle_lanes triangle_lanes::from_record(const triangle_record& triangle)
+	{
+		using namespace DirectX;
+		return {
+				XMVectorReplicate(triangle.v0.x), XMVectorReplicate(triangle.v0.y), XMVectorReplicate(triangle.v0.z),
+				XMVectorReplicate(triangle.edge1.x), XMVectorReplicate(triangle.edge1.y), XMVectorReplicate(triangle.edge1.z),
+				XMVectorReplicate(triangle.edge2.x), XMVectorReplicate(triangle.edge2.y), XMVectorReplicate(triangle.edge2.z)};
+	}
+
+	inline int get_lane_mask(DirectX::FXMVECTOR mask)
+	{
+		using namespace DirectX;
+#ifdef _XM_SSE_INTRINSICS_
+		return _mm_movemask_ps(mask);
+#else
+		return (XMVectorGetIntX(mask) ? 1 : 0) | (XMVectorGetIntY(mask) ? 2 : 0) |
+			   (XMVectorGetIntZ(mask) ? 4 : 0) | (XMVectorGetIntW(mask) ? 8 : 0);
+#endif
+	}
+
+	inline int intersect_triangle_lanes(const ray_packet& ray, const triangle_lanes& triangle,
+										DirectX::FXMVECTOR min_t, DirectX::FXMVECTOR max_t,
+										DirectX::XMVECTOR& t, DirectX::XMVECTOR& u, DirectX::XMVECTOR& v)
+	{
+		using namespace DirectX;
+		const auto dot3 = [](FXMVECTOR ax, FXMVECTOR ay, FXMVECTOR az, GXMVECTOR bx, HXMVECTOR by, HXMVECTOR bz) {
+			return XMVectorMultiplyAdd(ax, bx, XMVectorMultiplyAdd(ay, by, XMVectorMultiply(az, bz)));
+		};
+
+		// p = direction x edge2
+		const XMVECTOR pX = XMVectorSubtract(XMVectorMultiply(ray.direction_y, triangle.edge2_z), XMVectorMultiply(ray.direction_z, triangle.edge2_y));
+		const XMVECTOR pY = XMVectorSubtract(XMVectorMultiply(ray.direction_z, triangle.edge2_x), XMVectorMultiply(ray.direction_x, triangle.edge2_z));
+		const XMVECTOR pZ = XMVectorSubtract(XMVectorMultiply(ray.direction_x, triangle.edge2_y), XMVectorMultiply(ray.direction_y, triangle.edge2_x));
+		const XMVECTOR det = dot3(triangle.edge1_x, triangle.edge1_y, triangle.edge1_z, pX, pY, pZ);
+		const XMVECTOR invDet = XMVectorReciprocal(det);
+
+		const XMVECTOR sX = XMVectorSubtract(ray.origin_x, triangle.v0_x);
+		const XMVECTOR sY = XMVectorSubtract(ray.origin_y, triangle.v0_y);
+		const XMVECTOR sZ = XMVectorSubtract(ray.origin_z, triangle.v0_z);
+		u = XMVectorMultiply(dot3(sX, sY, sZ, pX, pY, pZ), invDet);
+
+		// q = s x edge1
+		const XMVECTOR qX = XMVectorSubtract(XMVectorMultiply(sY, triangle.edge1_z), XMVectorMultiply(sZ, triangle.edge1_y));
+		const XMVECTOR qY = XMVectorSubtract(XMVectorMultiply(sZ, triangle.edge1_x), XMVectorMultiply(sX, triangle.edge1_z));
+		const XMVECTOR qZ = XMVectorSubtract(XMVectorMultiply(sX, triangle.edge1_y), XMVectorMultiply(sY, triangle.edge1_x));
+		v = XMVectorMultiply(dot3(ray.direction_x, ray.direction_y, ray.direction_z, qX, qY, qZ), invDet);
+		t = XMVectorMultiply(dot3(triangle.edge2_x, triangle.edge2_y, triangle.edge2_z, qX, qY, qZ), invDet);
+
+		// Parallel rays and degenerate triangles have zero determinant
+		XMVECTOR mask = XMVectorGreaterOrEqual(XMVectorAbs(det), XMVectorReplicate(1e-20f));
+		mask = XMVectorAndInt(mask, XMVectorGreaterOrEqual(u, XMVectorZero()));
+		mask = XMVectorAndInt(mask, XMVectorLessOrEqual(u, XMVectorSplatOne()));
+		mask = XMVectorAndInt(mask, XMVectorGreaterOrEqual(v, XMVectorZero()));
+		mask = XMVectorAndInt(mask, XMVectorLessOrEqual(XMVectorAdd(u, v), XMVectorSplatOne()));
+		mask = XMVectorAndInt(mask, XMVectorGreaterOrEqual(t, min_t));
+		mask = XMVectorAndInt(mask, XMVectorLessOrEqual(t, max_t));
+		return get_lane_mask(mask);
+	}
+} // namespace cg::renderer
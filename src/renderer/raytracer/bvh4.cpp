@@ -0,0 +1,382 @@
+#include "bvh4.h"
+
+#include <array>
+#include <limits>
+
+using namespace DirectX;
+
+namespace
+{
+	cg::renderer::triangle_lanes load_pack(const cg::renderer::triangle_pack& pack)
+	{
+		return {
+				XMLoadFloat4A(&pack.v0_x), XMLoadFloat4A(&pack.v0_y), XMLoadFloat4A(&pack.v0_z),
+				XMLoadFloat4A(&pack.edge1_x), XMLoadFloat4A(&pack.edge1_y), XMLoadFloat4A(&pack.edge1_z),
+				XMLoadFloat4A(&pack.edge2_x), XMLoadFloat4A(&pack.edge2_y), XMLoadFloat4A(&pack.edge2_z)};
+	}
+}
+
+void cg::renderer::bvh4::build(const bvh& source, const std::vector<triangle_record>& triangles)
+{
+	nodes.clear();
+	packs.clear();
+	if (source.get_num_nodes() == 0)
+	{
+		return;
+	}
+	collapse(source, 0, triangles);
+}
+
+unsigned cg::renderer::bvh4::collapse(const bvh& source, unsigned node_idx,
+									   const std::vector<triangle_record>& triangles)
+{
+	const bvh_node* sourceNodes = source.get_nodes();
+
+	std::array<unsigned, width> children;
+	size_t numChildren = 0;
+	const bvh_node& node = sourceNodes[node_idx];
+	if (node.is_leaf())
+	{
+		children[numChildren++] = node_idx;
+	}
+	else
+	{
+		children[numChildren++] = node.left_first;
+		children[numChildren++] = node.left_first + 1;
+	}
+
+	// Pull grandchildren up until the node is full, opening the largest inner child first
+	while (numChildren != width)
+	{
+		int largestIdx = -1;
+		float largestArea = -1.0f;
+		for (size_t i = 0; i != numChildren; ++i)
+		{
+			const bvh_node& child = sourceNodes[children[i]];
+			const float area = aabb{child.aabb_min, child.aabb_max}.surface_area();
+			if (!child.is_leaf() && area > largestArea)
+			{
+				largestIdx = static_cast<int>(i);
+				largestArea = area;
+			}
+		}
+		if (largestIdx == -1)
+		{
+			break;
+		}
+		const unsigned opened = children[largestIdx];
+		children[largestIdx] = sourceNodes[opened].left_first;
+		children[numChildren++] = sourceNodes[opened].left_first + 1;
+	}
+
+	const unsigned wideIdx = static_cast<unsigned>(nodes.size());
+	nodes.push_back({});
+	{
+		// Box at infinity is missed by every ray, whatever its direction is
+		constexpr float inf = std::numeric_limits<float>::infinity();
+		bvh4_node& wide = nodes[wideIdx];
+		for (XMFLOAT4A* bound : {&wide.min_x, &wide.min_y, &wide.min_z, &wide.max_x, &wide.max_y, &wide.max_z})
+		{
+			XMStoreFloat4A(bound, XMVectorReplicate(inf));
+		}
+	}
+
+	for (size_t i = 0; i != numChildren; ++i)
+	{
+		const bvh_node& child = sourceNodes[children[i]];
+		unsigned childIdx;
+		unsigned count = 0;
+		if (child.is_leaf())
+		{
+			childIdx = static_cast<unsigned>(packs.size());
+			count = child.primitive_count;
+			add_leaf(child, triangles);
+		}
+		else
+		{
+			childIdx = collapse(source, children[i], triangles);
+		}
+
+		// Recursion may reallocate nodes
+		bvh4_node& wide = nodes[wideIdx];
+		(&wide.min_x.x)[i] = child.aabb_min.x;
+		(&wide.min_y.x)[i] = child.aabb_min.y;
+		(&wide.min_z.x)[i] = child.aabb_min.z;
+		(&wide.max_x.x)[i] = child.aabb_max.x;
+		(&wide.max_y.x)[i] = child.aabb_max.y;
+		(&wide.max_z.x)[i] = child.aabb_max.z;
+		wide.child[i] = childIdx;
+		wide.count[i] = count;
+	}
+	return wideIdx;
+}
+
+void cg::renderer::bvh4::add_leaf(const bvh_node& leaf, const std::vector<triangle_record>& triangles)
+{
+	for (unsigned first = 0; first < leaf.primitive_count; first += width)
+	{
+		triangle_pack pack{};
+		for (unsigned lane = 0; lane != width && first + lane != leaf.primitive_count; ++lane)
+		{
+			const unsigned primitiveIdx = leaf.left_first + first + lane;
+			const triangle_record& triangle = triangles[primitiveIdx];
+			(&pack.v0_x.x)[lane] = triangle.v0.x;
+			(&pack.v0_y.x)[lane] = triangle.v0.y;
+			(&pack.v0_z.x)[lane] = triangle.v0.z;
+			(&pack.edge1_x.x)[lane] = triangle.edge1.x;
+			(&pack.edge1_y.x)[lane] = triangle.edge1.y;
+			(&pack.edge1_z.x)[lane] = triangle.edge1.z;
+			(&pack.edge2_x.x)[lane] = triangle.edge2.x;
+			(&pack.edge2_y.x)[lane] = triangle.edge2.y;
+			(&pack.edge2_z.x)[lane] = triangle.edge2.z;
+			pack.primitive_idx[lane] = primitiveIdx;
+		}
+		packs.push_back(pack);
+	}
+}
+
+bool cg::renderer::bvh4::closest_hit(FXMVECTOR origin, FXMVECTOR direction, float min_t, float& max_t,
+									 unsigned& primitive_idx, float& u, float& v) const
+{
+	return traverse<false>(origin, direction, min_t, max_t, primitive_idx, u, v);
+}
+
+bool cg::renderer::bvh4::any_hit(FXMVECTOR origin, FXMVECTOR direction, float min_t, float max_t) const
+{
+	unsigned primitiveIdx;
+	float u, v;
+	return traverse<true>(origin, direction, min_t, max_t, primitiveIdx, u, v);
+}
+
+int cg::renderer::bvh4::closest_hit_packet(const ray_packet& packet, FXMVECTOR min_t, XMVECTOR& max_t,
+											unsigned (&primitive_idx)[4], XMVECTOR& u, XMVECTOR& v) const
+{
+	if (nodes.empty())
+	{
+		return 0;
+	}
+	trace_counters& counters = thread_counters;
+
+	struct stack_entry
+	{
+		XMVECTOR entry_t;
+		unsigned index;
+		unsigned count;
+		int active_mask;
+	};
+	stack_entry stack[(width - 1) * bvh::max_depth + 1];
+	size_t stack_size = 0;
+	stack[stack_size++] = {min_t, 0, 0, 0xf};
+	int hitMask = 0;
+
+	while (stack_size != 0)
+	{
+		const stack_entry current = stack[--stack_size];
+		// Rays that have already found a closer hit leave the subtree
+		const int activeMask = current.active_mask & get_lane_mask(XMVectorLessOrEqual(current.entry_t, max_t));
+		if (activeMask == 0)
+		{
+			continue;
+		}
+
+		if (current.count != 0)
+		{
+			// Every triangle of the leaf is replicated into lanes and tested against all rays
+			counters.triangles_tested += current.count;
+			for (unsigned i = 0; i != current.count; ++i)
+			{
+				const triangle_pack& pack = packs[current.index + i / width];
+				const unsigned lane = i % width;
+				const triangle_lanes triangle{
+						XMVectorReplicate((&pack.v0_x.x)[lane]), XMVectorReplicate((&pack.v0_y.x)[lane]),
+						XMVectorReplicate((&pack.v0_z.x)[lane]), XMVectorReplicate((&pack.edge1_x.x)[lane]),
+						XMVectorReplicate((&pack.edge1_y.x)[lane]), XMVectorReplicate((&pack.edge1_z.x)[lane]),
+						XMVectorReplicate((&pack.edge2_x.x)[lane]), XMVectorReplicate((&pack.edge2_y.x)[lane]),
+						XMVectorReplicate((&pack.edge2_z.x)[lane])};
+				XMVECTOR t, hitU, hitV;
+				const int mask = intersect_triangle_lanes(packet, triangle, min_t, max_t, t, hitU, hitV) & activeMask;
+				if (mask == 0)
+				{
+					continue;
+				}
+
+				// Only rays that found a closer hit are updated
+				const XMVECTOR select = XMVectorSelectControl(mask & 1, (mask >> 1) & 1, (mask >> 2) & 1, (mask >> 3) & 1);
+				max_t = XMVectorSelect(max_t, t, select);
+				u = XMVectorSelect(u, hitU, select);
+				v = XMVectorSelect(v, hitV, select);
+				for (unsigned ray = 0; ray != width; ++ray)
+				{
+					if (mask & (1 << ray))
+					{
+						primitive_idx[ray] = pack.primitive_idx[lane];
+					}
+				}
+				hitMask |= mask;
+			}
+			continue;
+		}
+
+		// Each child box is tested against all rays, rays that missed the parent don't take part
+		const bvh4_node& node = nodes[current.index];
+		counters.boxes_tested += width;
+		stack_entry hits[width];
+		float hitOrder[width];
+		size_t numHits = 0;
+		for (unsigned child = 0; child != width; ++child)
+		{
+			const bvh_node box{
+					{(&node.min_x.x)[child], (&node.min_y.x)[child], (&node.min_z.x)[child]}, 0,
+					{(&node.max_x.x)[child], (&node.max_y.x)[child], (&node.max_z.x)[child]}, 0};
+			XMVECTOR entryT;
+			const int childMask = bvh::intersect_box_packet(box, packet, min_t, max_t, entryT) & activeMask;
+			if (childMask == 0)
+			{
+				continue;
+			}
+
+			// Coherent rays agree on the order, so children are sorted by the nearest entry of any hitting ray
+			const XMVECTOR maskedT = XMVectorSelect(XMVectorReplicate(FLT_MAX), entryT,
+													XMVectorSelectControl(childMask & 1, (childMask >> 1) & 1,
+																		  (childMask >> 2) & 1, (childMask >> 3) & 1));
+			XMFLOAT4A laneT;
+			XMStoreFloat4A(&laneT, maskedT);
+			const float order = std::min({laneT.x, laneT.y, laneT.z, laneT.w});
+			const stack_entry entry{entryT, node.child[child], node.count[child], childMask};
+			size_t i = numHits++;
+			for (; i != 0 && hitOrder[i - 1] > order; --i)
+			{
+				hits[i] = hits[i - 1];
+				hitOrder[i] = hitOrder[i - 1];
+			}
+			hits[i] = entry;
+			hitOrder[i] = order;
+		}
+
+		// Push the far children first, so the nearest one is visited next
+		for (size_t i = numHits; i != 0; --i)
+		{
+			stack[stack_size++] = hits[i - 1];
+		}
+	}
+	return hitMask;
+}
+
+template<bool bAnyHit>
+bool cg::renderer::bvh4::traverse(FXMVECTOR origin, FXMVECTOR direction, float min_t, float& max_t,
+								  unsigned& primitive_idx, float& u, float& v) const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+	trace_counters& counters = thread_counters;
+
+	const ray_packet ray = ray_packet::from_ray(origin, direction);
+	const XMVECTOR minT = XMVectorReplicate(min_t);
+
+	// Leaves are pushed with their triangle count, so they are visited in order with inner nodes
+	struct stack_entry
+	{
+		unsigned index;
+		unsigned count;
+		float entry_t;
+	};
+	// Every level replaces one entry with at most four
+	stack_entry stack[(width - 1) * bvh::max_depth + 1];
+	size_t stack_size = 0;
+	stack[stack_size++] = {0, 0, min_t};
+	bool bHasHit = false;
+
+	while (stack_size != 0)
+	{
+		const stack_entry current = stack[--stack_size];
+		// Closer hit is already found, so the node can't contain anything better
+		if (current.entry_t > max_t)
+		{
+			continue;
+		}
+
+		if (current.count != 0)
+		{
+			counters.triangles_tested += current.count;
+			const unsigned numPacks = (current.count + width - 1) / width;
+			for (unsigned packIdx = current.index; packIdx != current.index + numPacks; ++packIdx)
+			{
+				XMVECTOR packT, packU, packV;
+				const int hitMask = intersect_triangle_lanes(ray, load_pack(packs[packIdx]), minT, XMVectorReplicate(max_t),
+															 packT, packU, packV);
+				if (hitMask == 0)
+				{
+					continue;
+				}
+				if constexpr (bAnyHit)
+				{
+					return true;
+				}
+
+				XMFLOAT4A laneT, laneU, laneV;
+				XMStoreFloat4A(&laneT, packT);
+				XMStoreFloat4A(&laneU, packU);
+				XMStoreFloat4A(&laneV, packV);
+				for (unsigned lane = 0; lane != width; ++lane)
+				{
+					if ((hitMask & (1 << lane)) && (&laneT.x)[lane] <= max_t)
+					{
+						max_t = (&laneT.x)[lane];
+						u = (&laneU.x)[lane];
+						v = (&laneV.x)[lane];
+						primitive_idx = packs[packIdx].primitive_idx[lane];
+						bHasHit = true;
+					}
+				}
+			}
+			continue;
+		}
+
+		// Slab test of all four children
+		const bvh4_node& node = nodes[current.index];
+		counters.boxes_tested += width;
+		const XMVECTOR tx0 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat4A(&node.min_x), ray.origin_x), ray.inv_direction_x);
+		const XMVECTOR tx1 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat4A(&node.max_x), ray.origin_x), ray.inv_direction_x);
+		const XMVECTOR ty0 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat4A(&node.min_y), ray.origin_y), ray.inv_direction_y);
+		const XMVECTOR ty1 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat4A(&node.max_y), ray.origin_y), ray.inv_direction_y);
+		const XMVECTOR tz0 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat4A(&node.min_z), ray.origin_z), ray.inv_direction_z);
+		const XMVECTOR tz1 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat4A(&node.max_z), ray.origin_z), ray.inv_direction_z);
+		const XMVECTOR tNear = XMVectorMax(XMVectorMax(XMVectorMin(tx0, tx1), XMVectorMin(ty0, ty1)),
+										   XMVectorMax(XMVectorMin(tz0, tz1), minT));
+		const XMVECTOR tFar = XMVectorMin(XMVectorMin(XMVectorMax(tx0, tx1), XMVectorMax(ty0, ty1)),
+										  XMVectorMin(XMVectorMax(tz0, tz1), XMVectorReplicate(max_t)));
+		const int hitMask = get_lane_mask(XMVectorLessOrEqual(tNear, tFar));
+		if (hitMask == 0)
+		{
+			continue;
+		}
+
+		// Sort hit children by entry distance
+		XMFLOAT4A entryT;
+		XMStoreFloat4A(&entryT, tNear);
+		stack_entry hits[width];
+		size_t numHits = 0;
+		for (unsigned lane = 0; lane != width; ++lane)
+		{
+			if (hitMask & (1 << lane))
+			{
+				const stack_entry entry{node.child[lane], node.count[lane], (&entryT.x)[lane]};
+				size_t i = numHits++;
+				for (; i != 0 && hits[i - 1].entry_t > entry.entry_t; --i)
+				{
+					hits[i] = hits[i - 1];
+				}
+				hits[i] = entry;
+			}
+		}
+
+		// Push the far children first, so the nearest one is visited next
+		for (size_t i = numHits; i != 0; --i)
+		{
+			stack[stack_size++] = hits[i - 1];
+		}
+	}
+	return bHasHit;
+}
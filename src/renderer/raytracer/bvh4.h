@@ -0,0 +1,65 @@
+#pragma once
+
+#include "bvh.h"
+
+#include "DirectXMath.h"
+
+#include <vector>
+
+namespace cg::renderer
+{
+	// Node of the 4-wide hierarchy. Bounds of the children are stored as structure of arrays,
+	// so one vector operation tests all four boxes. Unused slots have an empty box at infinity
+	struct bvh4_node
+	{
+		DirectX::XMFLOAT4A min_x, min_y, min_z;
+		DirectX::XMFLOAT4A max_x, max_y, max_z;
+		unsigned child[4]; // node index for inner children, first triangle pack for leaves
+		unsigned count[4]; // 0 for inner children, number of triangles for leaves
+	};
+
+
+	// Four triangles tested against a ray at once. Unused lanes have zero edges and never hit
+	struct triangle_pack
+	{
+		DirectX::XMFLOAT4A v0_x, v0_y, v0_z;
+		DirectX::XMFLOAT4A edge1_x, edge1_y, edge1_z;
+		DirectX::XMFLOAT4A edge2_x, edge2_y, edge2_z;
+		unsigned primitive_idx[4]; // index of the triangle record
+	};
+
+
+	// Hierarchy with four children per node collapsed from the binary one
+	class bvh4
+	{
+	public:
+		void build(const bvh& source, const std::vector<triangle_record>& triangles);
+
+		// Find the closest triangle, u and v are barycentric coordinates of its vertices 1 and 2
+		bool closest_hit(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction, float min_t, float& max_t,
+						 unsigned& primitive_idx, float& u, float& v) const;
+
+		// Stop at the first triangle found
+		bool any_hit(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction, float min_t, float max_t) const;
+
+		// Closest triangles of four rays traced together, returns mask of lanes that hit. max_t lanes shrink to
+		// the hits, primitive_idx is set for hit lanes only. Children are visited while any active ray hits them
+		int closest_hit_packet(const ray_packet& packet, DirectX::FXMVECTOR min_t, DirectX::XMVECTOR& max_t,
+							   unsigned (&primitive_idx)[4], DirectX::XMVECTOR& u, DirectX::XMVECTOR& v) const;
+
+		size_t get_num_nodes() const { return nodes.size(); }
+
+		static constexpr size_t width = 4;
+
+	protected:
+		unsigned collapse(const bvh& source, unsigned node_idx, const std::vector<triangle_record>& triangles);
+		void add_leaf(const bvh_node& leaf, const std::vector<triangle_record>& triangles);
+
+		template<bool bAnyHit>
+		bool traverse(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction, float min_t, float& max_t,
+					  unsigned& primitive_idx, float& u, float& v) const;
+
+		std::vector<bvh4_node> nodes;
+		std::vector<triangle_pack> packs;
+	};
+}// namespace cg::renderer
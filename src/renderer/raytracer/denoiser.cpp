@@ -0,0 +1,215 @@
+#include "denoiser.h"
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+
+using namespace DirectX;
+
+namespace
+{
+	// Edge-stopping parameters, colour one is halved every iteration as the noise goes down
+	constexpr float sigma_color = 0.6f;
+	constexpr float sigma_albedo = 0.1f;
+	constexpr float sigma_normal = 0.3f;
+	constexpr float sigma_depth = 0.05f; // relative to the depth of the center pixel
+
+	constexpr float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+	// Horizontally adjacent pixels filtered together, one per vector lane
+	constexpr size_t lanes = 4;
+
+	// Image kept as one plane per channel, so the same channel of adjacent pixels loads as one vector
+	using planes = std::array<std::vector<float>, 3>;
+
+	// Values of lanes pixels starting at x in row y, pixels outside of the image are clamped to its border
+	XMVECTOR load_lanes(const std::vector<float>& plane, long x, long y, long width, long height)
+	{
+		const size_t row = static_cast<size_t>(std::clamp(y, 0l, height - 1) * width);
+		if (x >= 0 && x + static_cast<long>(lanes) <= width)
+		{
+			return XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(&plane[row + x]));
+		}
+		auto item = [&](long lane_x) { return plane[row + std::clamp(lane_x, 0l, width - 1)]; };
+		return XMVectorSet(item(x), item(x + 1), item(x + 2), item(x + 3));
+	}
+
+	XMVECTOR get_distance_squared(const planes& source, const XMVECTOR (&center)[3], long x, long y, long width,
+								  long height, XMVECTOR* samples = nullptr)
+	{
+		XMVECTOR result = XMVectorZero();
+		for (size_t channel = 0; channel != 3; ++channel)
+		{
+			const XMVECTOR sample = load_lanes(source[channel], x, y, width, height);
+			const XMVECTOR difference = XMVectorSubtract(sample, center[channel]);
+			result = XMVectorMultiplyAdd(difference, difference, result);
+			if (samples)
+			{
+				samples[channel] = sample;
+			}
+		}
+		return result;
+	}
+}
+
+void cg::renderer::denoise(resource<color>& image, feature_buffers& features, unsigned iterations,
+						   utils::tile_scheduler* scheduler)
+{
+	if (!features.albedo || !features.normal || !features.depth)
+	{
+		THROW_ERROR("Denoiser needs albedo, normal and depth buffers");
+	}
+
+	if (iterations == 0)
+	{
+		return;
+	}
+
+	const size_t width = image.get_stride();
+	const size_t height = image.get_number_of_elements() / width;
+	resource<color>& albedo = *features.albedo;
+	resource<color>& normal = *features.normal;
+	resource<float>& depth = *features.depth;
+
+	auto run = [&](auto&& kernel_tile) {
+		if (scheduler)
+		{
+			scheduler->run(width, height, kernel_tile);
+		}
+		else
+		{
+			kernel_tile({0, 0, width, height});
+		}
+	};
+
+	// Buffers are split into planes once, iterations ping-pong between two colour sets of them
+	planes colorPlanes, scratchPlanes, albedoPlanes, normalPlanes;
+	for (planes* buffer : {&colorPlanes, &scratchPlanes, &albedoPlanes, &normalPlanes})
+	{
+		for (std::vector<float>& plane : *buffer)
+		{
+			plane.resize(width * height);
+		}
+	}
+	std::vector<float> depthPlane(width * height);
+	run([&](const utils::tile& tile) {
+		for (size_t y = tile.y_begin; y != tile.y_end; ++y)
+		{
+			for (size_t x = tile.x_begin; x != tile.x_end; ++x)
+			{
+				const size_t i = y * width + x;
+				const color& c = image.item(x, y);
+				const color& a = albedo.item(x, y);
+				const color& n = normal.item(x, y);
+				colorPlanes[0][i] = c.r;
+				colorPlanes[1][i] = c.g;
+				colorPlanes[2][i] = c.b;
+				albedoPlanes[0][i] = a.r;
+				albedoPlanes[1][i] = a.g;
+				albedoPlanes[2][i] = a.b;
+				normalPlanes[0][i] = n.r;
+				normalPlanes[1][i] = n.g;
+				normalPlanes[2][i] = n.b;
+				depthPlane[i] = depth.item(x, y);
+			}
+		}
+	});
+
+	const long w = static_cast<long>(width);
+	const long h = static_cast<long>(height);
+	planes* source = &colorPlanes;
+	planes* destination = &scratchPlanes;
+	for (unsigned iteration = 0; iteration != iterations; ++iteration)
+	{
+		const long step = 1l << iteration;
+		const XMVECTOR invColorVariance = XMVectorReplicate(
+				1.0f / (sigma_color * sigma_color * std::exp2(-2.0f * static_cast<float>(iteration))));
+		const XMVECTOR invAlbedoVariance = XMVectorReplicate(1.0f / (sigma_albedo * sigma_albedo));
+		const XMVECTOR invNormalVariance = XMVectorReplicate(1.0f / (sigma_normal * sigma_normal));
+
+		auto filter_tile = [&](const utils::tile& tile) {
+			for (long y = static_cast<long>(tile.y_begin); y != static_cast<long>(tile.y_end); ++y)
+			{
+				for (long x = static_cast<long>(tile.x_begin); x < static_cast<long>(tile.x_end); x += lanes)
+				{
+					XMVECTOR centerColor[3], centerAlbedo[3], centerNormal[3];
+					for (size_t channel = 0; channel != 3; ++channel)
+					{
+						centerColor[channel] = load_lanes((*source)[channel], x, y, w, h);
+						centerAlbedo[channel] = load_lanes(albedoPlanes[channel], x, y, w, h);
+						centerNormal[channel] = load_lanes(normalPlanes[channel], x, y, w, h);
+					}
+					const XMVECTOR centerDepth = load_lanes(depthPlane, x, y, w, h);
+					const XMVECTOR invDepthScale = XMVectorReciprocal(
+							XMVectorScale(XMVectorMax(centerDepth, XMVectorReplicate(FLT_MIN)), sigma_depth));
+
+					XMVECTOR sum[3] = {XMVectorZero(), XMVectorZero(), XMVectorZero()};
+					XMVECTOR weightSum = XMVectorZero();
+					for (int ky = 0; ky != 5; ++ky)
+					{
+						const long sy = y + (ky - 2) * step;
+						for (int kx = 0; kx != 5; ++kx)
+						{
+							const long sx = x + (kx - 2) * step;
+							XMVECTOR sampleColor[3];
+							const XMVECTOR colorDistance = get_distance_squared(*source, centerColor, sx, sy, w, h, sampleColor);
+							const XMVECTOR albedoDistance = get_distance_squared(albedoPlanes, centerAlbedo, sx, sy, w, h);
+							const XMVECTOR normalDistance = get_distance_squared(normalPlanes, centerNormal, sx, sy, w, h);
+							const XMVECTOR depthDistance = XMVectorMultiply(
+									XMVectorAbs(XMVectorSubtract(load_lanes(depthPlane, sx, sy, w, h), centerDepth)), invDepthScale);
+
+							XMVECTOR exponent = XMVectorMultiply(colorDistance, invColorVariance);
+							exponent = XMVectorMultiplyAdd(albedoDistance, invAlbedoVariance, exponent);
+							exponent = XMVectorMultiplyAdd(normalDistance, invNormalVariance, exponent);
+							exponent = XMVectorMultiplyAdd(depthDistance, depthDistance, exponent);
+							const XMVECTOR weight = XMVectorScale(XMVectorExpE(XMVectorNegate(exponent)), kernel[kx] * kernel[ky]);
+
+							for (size_t channel = 0; channel != 3; ++channel)
+							{
+								sum[channel] = XMVectorMultiplyAdd(sampleColor[channel], weight, sum[channel]);
+							}
+							weightSum = XMVectorAdd(weightSum, weight);
+						}
+					}
+
+					// Center sample always has weight of kernel[2] squared, so the sum is never zero.
+					// Background needs no filtering, it isn't sampled by random paths
+					const XMVECTOR isForeground = XMVectorGreater(centerDepth, XMVectorZero());
+					const XMVECTOR invWeightSum = XMVectorReciprocal(weightSum);
+					const size_t count = std::min(lanes, static_cast<size_t>(static_cast<long>(tile.x_end) - x));
+					for (size_t channel = 0; channel != 3; ++channel)
+					{
+						const XMVECTOR result = XMVectorSelect(centerColor[channel],
+															   XMVectorMultiply(sum[channel], invWeightSum), isForeground);
+						float* out = &(*destination)[channel][y * width + x];
+						if (count == lanes)
+						{
+							XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(out), result);
+						}
+						else
+						{
+							XMFLOAT4 partial;
+							XMStoreFloat4(&partial, result);
+							std::copy_n(&partial.x, count, out);
+						}
+					}
+				}
+			}
+		};
+
+		run(filter_tile);
+		std::swap(source, destination);
+	}
+
+	run([&](const utils::tile& tile) {
+		for (size_t y = tile.y_begin; y != tile.y_end; ++y)
+		{
+			for (size_t x = tile.x_begin; x != tile.x_end; ++x)
+			{
+				const size_t i = y * width + x;
+				image.item(x, y) = {(*source)[0][i], (*source)[1][i], (*source)[2][i]};
+			}
+		}
+	});
+}
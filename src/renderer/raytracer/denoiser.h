@@ -0,0 +1,23 @@
+#pragma once
+
+#include "resource.h"
+#include "utils/tile_scheduler.h"
+
+namespace cg::renderer
+{
+	// Per-pixel features of primary hits guiding the denoiser
+	struct feature_buffers
+	{
+		std::shared_ptr<resource<color>> albedo;
+		std::shared_ptr<resource<color>> normal;
+		std::shared_ptr<resource<float>> depth; // distance to the hit, 0 for misses
+	};
+
+
+	// Edge-aware a-trous wavelet filter (Dammertz et al. 2010). Every iteration applies the 5x5 B3 spline kernel
+	// with holes twice as wide as the previous one, weighted down across edges of colour, albedo, normal and depth.
+	// Four horizontally adjacent pixels are filtered at once in vector lanes of per-channel planes.
+	// Tiles are filtered by the scheduler, without it the image is filtered on the calling thread
+	void denoise(resource<color>& image, feature_buffers& features, unsigned iterations,
+				 utils::tile_scheduler* scheduler);
+}// namespace cg::renderer
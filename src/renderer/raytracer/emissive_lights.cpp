@@ -0,0 +1,270 @@
+#include "emissive_lights.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+using namespace DirectX;
+
+void cg::renderer::emissive_lights::build(std::vector<emissive_triangle> in_triangles)
+{
+	triangles = std::move(in_triangles);
+	build_alias_table();
+	build_tree();
+}
+
+void cg::renderer::emissive_lights::build_alias_table()
+{
+	probability.assign(triangles.size(), 1.0f);
+	alias.resize(triangles.size());
+	total_power = 0.0f;
+	for (const emissive_triangle& triangle : triangles)
+	{
+		total_power += triangle.power;
+	}
+	if (triangles.empty() || total_power <= 0.0f)
+	{
+		return;
+	}
+
+	// Vose's method: columns below the average are filled up by the ones above it
+	std::vector<float> scaled(triangles.size());
+	std::vector<unsigned> small, large;
+	for (unsigned i = 0; i != triangles.size(); ++i)
+	{
+		alias[i] = i;
+		scaled[i] = triangles[i].power * static_cast<float>(triangles.size()) / total_power;
+		(scaled[i] < 1.0f ? small : large).push_back(i);
+	}
+	while (!small.empty() && !large.empty())
+	{
+		const unsigned lower = small.back();
+		small.pop_back();
+		const unsigned upper = large.back();
+
+		probability[lower] = scaled[lower];
+		alias[lower] = upper;
+		scaled[upper] -= 1.0f - scaled[lower];
+		if (scaled[upper] < 1.0f)
+		{
+			large.pop_back();
+			small.push_back(upper);
+		}
+	}
+	// Leftovers are full columns up to rounding
+	for (unsigned i : small)
+	{
+		probability[i] = 1.0f;
+	}
+	for (unsigned i : large)
+	{
+		probability[i] = 1.0f;
+	}
+}
+
+cg::renderer::emitter_sample cg::renderer::emissive_lights::sample(float u_select, float u1, float u2) const
+{
+	// Integer part of the scaled number selects the column, fraction decides between it and its alias
+	const float scaled = u_select * static_cast<float>(triangles.size());
+	const unsigned column = std::min(static_cast<unsigned>(scaled), static_cast<unsigned>(triangles.size() - 1));
+	const unsigned triangleIdx = scaled - static_cast<float>(column) < probability[column] ? column : alias[column];
+	return sample_triangle(triangleIdx, get_pmf(triangleIdx), u1, u2);
+}
+
+cg::renderer::emitter_sample cg::renderer::emissive_lights::sample(FXMVECTOR position, FXMVECTOR normal,
+																   float u_select, float u1, float u2) const
+{
+	unsigned nodeIdx = 0;
+	float pmf = 1.0f;
+	while (!tree[nodeIdx].is_leaf())
+	{
+		const unsigned left = tree[nodeIdx].left_first;
+		float leftImportance = get_importance(tree[left], position, normal);
+		float rightImportance = get_importance(tree[left + 1], position, normal);
+		// Neither child can light the point, power keeps the estimate unbiased anyway
+		if (leftImportance + rightImportance <= 0.0f)
+		{
+			leftImportance = tree[left].power;
+			rightImportance = tree[left + 1].power;
+		}
+
+		const float leftProbability = leftImportance / (leftImportance + rightImportance);
+		if (u_select < leftProbability)
+		{
+			nodeIdx = left;
+			u_select /= leftProbability;
+			pmf *= leftProbability;
+		}
+		else
+		{
+			nodeIdx = left + 1;
+			u_select = (u_select - leftProbability) / (1.0f - leftProbability);
+			pmf *= 1.0f - leftProbability;
+		}
+		u_select = std::min(u_select, 0x1.fffffep-1f);
+	}
+	return sample_triangle(tree[nodeIdx].left_first, pmf, u1, u2);
+}
+
+float cg::renderer::emissive_lights::get_pmf(unsigned triangle_idx) const
+{
+	return total_power > 0.0f ? triangles[triangle_idx].power / total_power : 0.0f;
+}
+
+cg::renderer::emitter_sample cg::renderer::emissive_lights::sample_triangle(unsigned triangle_idx, float pmf,
+																			float u1, float u2) const
+{
+	const emissive_triangle& triangle = triangles[triangle_idx];
+
+	// Square root warp gives uniform barycentrics
+	const float root = std::sqrt(u1);
+	const float b1 = 1.0f - root;
+	const float b2 = u2 * root;
+
+	emitter_sample result;
+	result.position = XMVectorAdd(XMLoadFloat3(&triangle.v0),
+								  XMVectorAdd(XMVectorScale(XMLoadFloat3(&triangle.edge1), b1),
+											  XMVectorScale(XMLoadFloat3(&triangle.edge2), b2)));
+	result.normal = XMLoadFloat3(&triangle.normal);
+	result.emission = XMLoadFloat3(&triangle.emission);
+	result.pdf = pmf / triangle.area;
+	return result;
+}
+
+void cg::renderer::emissive_lights::build_tree()
+{
+	tree.clear();
+	if (triangles.empty())
+	{
+		return;
+	}
+	std::vector<unsigned> order(triangles.size());
+	std::iota(order.begin(), order.end(), 0u);
+	tree.reserve(2 * triangles.size() - 1);
+	tree.emplace_back();
+	subdivide(0, order.data(), order.size());
+}
+
+void cg::renderer::emissive_lights::subdivide(unsigned node_idx, unsigned* order, size_t count)
+{
+	light_tree_node node{};
+	aabb centroidBounds;
+	for (size_t i = 0; i != count; ++i)
+	{
+		const emissive_triangle& triangle = triangles[order[i]];
+		const XMVECTOR v0 = XMLoadFloat3(&triangle.v0);
+		const XMVECTOR v1 = XMVectorAdd(v0, XMLoadFloat3(&triangle.edge1));
+		const XMVECTOR v2 = XMVectorAdd(v0, XMLoadFloat3(&triangle.edge2));
+		node.bounds.extend(v0);
+		node.bounds.extend(v1);
+		node.bounds.extend(v2);
+		centroidBounds.extend(XMVectorScale(XMVectorAdd(v0, XMVectorAdd(v1, v2)), 1.0f / 3.0f));
+
+		const orientation_cone cone{triangle.normal, 0.0f};
+		node.cone = i == 0 ? cone : orientation_cone::merge(node.cone, cone);
+		node.power += triangle.power;
+	}
+
+	if (count == 1)
+	{
+		node.left_first = order[0];
+		node.triangle_count = 1;
+		tree[node_idx] = node;
+		return;
+	}
+
+	// Median split of centroids along the longest axis keeps the tree balanced
+	const XMFLOAT3 extent(centroidBounds.upper.x - centroidBounds.lower.x,
+						  centroidBounds.upper.y - centroidBounds.lower.y,
+						  centroidBounds.upper.z - centroidBounds.lower.z);
+	const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	auto get_centroid = [&](unsigned triangle_idx) {
+		const emissive_triangle& triangle = triangles[triangle_idx];
+		return 3.0f * (&triangle.v0.x)[axis] + (&triangle.edge1.x)[axis] + (&triangle.edge2.x)[axis];
+	};
+	const size_t half = count / 2;
+	std::nth_element(order, order + half, order + count, [&](unsigned a, unsigned b) {
+		return get_centroid(a) < get_centroid(b);
+	});
+
+	const unsigned left = static_cast<unsigned>(tree.size());
+	tree.emplace_back();
+	tree.emplace_back();
+	node.left_first = left;
+	node.triangle_count = 0;
+	tree[node_idx] = node;
+	subdivide(left, order, half);
+	subdivide(left + 1, order + half, count - half);
+}
+
+float cg::renderer::emissive_lights::get_importance(const light_tree_node& node, FXMVECTOR position, FXMVECTOR normal)
+{
+	// Light of the node is bounded as if all its power were at the center of the box,
+	// oriented as favourably as the cone and the box extent allow
+	const XMVECTOR lower = XMLoadFloat3(&node.bounds.lower);
+	const XMVECTOR upper = XMLoadFloat3(&node.bounds.upper);
+	const XMVECTOR toLight = XMVectorSubtract(XMVectorScale(XMVectorAdd(lower, upper), 0.5f), position);
+	const float radius = 0.5f * XMVectorGetX(XMVector3Length(XMVectorSubtract(upper, lower)));
+	const float distance = XMVectorGetX(XMVector3Length(toLight));
+	// Points inside the box could be lit from any direction
+	if (distance <= radius)
+	{
+		return node.power / std::max(radius * radius, FLT_MIN);
+	}
+
+	const XMVECTOR lightDir = XMVectorScale(toLight, 1.0f / distance);
+	const float thetaU = std::asin(radius / distance);
+
+	// Emitters are two-sided, so the closer of the axis and its opposite counts
+	float theta = std::acos(std::clamp(-XMVectorGetX(XMVector3Dot(XMLoadFloat3(&node.cone.axis), lightDir)), -1.0f, 1.0f));
+	theta = std::min(theta, XM_PI - theta);
+	const float thetaEmitter = std::max(0.0f, theta - node.cone.theta_o - thetaU);
+	if (thetaEmitter >= XM_PIDIV2)
+	{
+		return 0.0f;
+	}
+
+	const float thetaReceiver = std::acos(std::clamp(XMVectorGetX(XMVector3Dot(normal, lightDir)), -1.0f, 1.0f));
+	const float thetaReceiverBound = std::max(0.0f, thetaReceiver - thetaU);
+	if (thetaReceiverBound >= XM_PIDIV2)
+	{
+		return 0.0f;
+	}
+
+	return node.power * std::cos(thetaEmitter) * std::cos(thetaReceiverBound) / (distance * distance);
+}
+
+cg::renderer::orientation_cone cg::renderer::orientation_cone::merge(const orientation_cone& a, const orientation_cone& b)
+{
+	// Wider cone is the starting point
+	if (b.theta_o > a.theta_o)
+	{
+		return merge(b, a);
+	}
+
+	const XMVECTOR axisA = XMLoadFloat3(&a.axis);
+	const XMVECTOR axisB = XMLoadFloat3(&b.axis);
+	const float cosThetaD = std::clamp(XMVectorGetX(XMVector3Dot(axisA, axisB)), -1.0f, 1.0f);
+	const float thetaD = std::acos(cosThetaD);
+	if (std::min(thetaD + b.theta_o, XM_PI) <= a.theta_o)
+	{
+		return a;
+	}
+
+	const float thetaO = 0.5f * (a.theta_o + thetaD + b.theta_o);
+	const float sinThetaD = std::sqrt(std::max(0.0f, 1.0f - cosThetaD * cosThetaD));
+	// Opposite axes leave no direction to rotate to
+	if (thetaO >= XM_PI || sinThetaD < 1e-6f)
+	{
+		return {a.axis, XM_PI};
+	}
+
+	// Rotate the axis of a towards b by the angle the cone grows
+	const float thetaR = thetaO - a.theta_o;
+	const XMVECTOR perpendicular = XMVectorScale(XMVectorSubtract(axisB, XMVectorScale(axisA, cosThetaD)), 1.0f / sinThetaD);
+	orientation_cone result;
+	XMStoreFloat3(&result.axis, XMVector3Normalize(XMVectorAdd(XMVectorScale(axisA, std::cos(thetaR)),
+																XMVectorScale(perpendicular, std::sin(thetaR)))));
+	result.theta_o = thetaO;
+	return result;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "bvh.h"
+
+#include "DirectXMath.h"
+
+#include <vector>
+
+namespace cg::renderer
+{
+	// Triangle of a material with non-zero emission
+	struct emissive_triangle
+	{
+		DirectX::XMFLOAT3 v0;
+		float area;
+		DirectX::XMFLOAT3 edge1; // v1 - v0
+		float power; // luminance of the emission times area
+		DirectX::XMFLOAT3 edge2; // v2 - v0
+		DirectX::XMFLOAT3 normal;
+		DirectX::XMFLOAT3 emission;
+	};
+
+
+	// Point picked on one of the emissive triangles
+	struct emitter_sample
+	{
+		DirectX::XMVECTOR position;
+		DirectX::XMVECTOR normal;
+		DirectX::XMVECTOR emission;
+		float pdf; // per unit area, includes the probability of picking the triangle
+	};
+
+
+	// Bound of the normals of a group of emitters: all of them are within theta_o of the axis
+	struct orientation_cone
+	{
+		DirectX::XMFLOAT3 axis;
+		float theta_o;
+
+		static orientation_cone merge(const orientation_cone& a, const orientation_cone& b);
+	};
+
+
+	// Node of the light hierarchy. Leaves hold a single triangle
+	struct light_tree_node
+	{
+		aabb bounds;
+		orientation_cone cone;
+		float power;
+		unsigned left_first; // left child for inner nodes, triangle for leaves
+		unsigned triangle_count; // 0 for inner nodes, right child is stored at left_first + 1
+
+		bool is_leaf() const { return triangle_count != 0; }
+	};
+
+
+	// Emissive triangles of the scene. They are picked in proportion to their power with an alias table,
+	// or by their importance to the shading point with a light hierarchy
+	class emissive_lights
+	{
+	public:
+		void build(std::vector<emissive_triangle> in_triangles);
+
+		bool empty() const { return triangles.empty(); }
+		size_t size() const { return triangles.size(); }
+		const std::vector<emissive_triangle>& get_triangles() const { return triangles; }
+
+		// Pick a triangle with u_select, then a uniform point on it with u1 and u2. All numbers are in [0, 1)
+		emitter_sample sample(float u_select, float u1, float u2) const;
+
+		// Descend the light hierarchy picking children by their estimated light at the point.
+		// u_select is rescaled at every level, so one number is enough for the whole path
+		emitter_sample sample(DirectX::FXMVECTOR position, DirectX::FXMVECTOR normal,
+							  float u_select, float u1, float u2) const;
+
+		// Probability of picking the triangle from the alias table
+		float get_pmf(unsigned triangle_idx) const;
+
+	protected:
+		void build_alias_table();
+		void build_tree();
+		void subdivide(unsigned node_idx, unsigned* order, size_t count);
+
+		// Upper bound of the light of a node at a point with a given normal
+		static float get_importance(const light_tree_node& node, DirectX::FXMVECTOR position, DirectX::FXMVECTOR normal);
+
+		emitter_sample sample_triangle(unsigned triangle_idx, float pmf, float u1, float u2) const;
+
+		std::vector<emissive_triangle> triangles;
+		// Column i keeps triangle i with probability[i], otherwise gives alias[i]
+		std::vector<float> probability;
+		std::vector<unsigned> alias;
+		float total_power = 0.0f;
+		std::vector<light_tree_node> tree;
+	};
+}// namespace cg::renderer
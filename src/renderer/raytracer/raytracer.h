@@ -1,15 +1,25 @@
 #pragma once
 
+#include "bvh.h"
+#include "bvh4.h"
+#include "denoiser.h"
+#include "emissive_lights.h"
+#include "render_stats.h"
+#include "reservoir.h"
 #include "resource.h"
+#include "sampler.h"
+#include "utils/tile_scheduler.h"
 #include "world/camera.h"
 
 #include "DirectXCollision.h"
 #include "DirectXMath.h"
 #include "linalg.h"
 
+#include <array>
+#include <chrono>
 #include <cmath>
 #include <memory>
-#include <set>
+#include <mutex>
 
 // Compare real values with tolerance
 template<class T>
@@ -76,12 +86,6 @@ namespace cg::renderer
 	{
 		float depth; // length of the ray
 		vertex point; // point of intersection
-
-		// comparison operator is used to find the closest hit
-		bool operator<(const payload& other) const
-		{
-			return depth < other.depth;
-		}
 	};
 
 
@@ -94,6 +98,44 @@ namespace cg::renderer
 	};
 
 
+	// Direct light of one source at a hit split by the outcome of the shadow test,
+	// so the test can be done later
+	struct light_sample
+	{
+		DirectX::XMVECTOR ambient;
+		DirectX::XMVECTOR diffuse_lit;
+		DirectX::XMVECTOR diffuse_shadowed;
+		DirectX::XMVECTOR specular; // lit points only
+		ray shadow_ray;
+		float distance; // to the light
+		bool bFacesLight; // back-faces get ambient light only and need no shadow ray
+	};
+
+
+	// Ray waiting in a queue of the wavefront pipeline. Pixel is the index inside the tile
+	struct queued_ray
+	{
+		DirectX::XMFLOAT3 origin;
+		unsigned pixel;
+		DirectX::XMFLOAT3 direction;
+		uint32_t sort_key;
+		DirectX::XMFLOAT3 throughput;
+		float min_t;
+		bool is_specular; // follows a mirror reflection, which light sampling can't pick, so emission of its hit counts
+	};
+
+
+	// Shadow ray carrying the light of both outcomes of the visibility test
+	struct queued_shadow_ray
+	{
+		queued_ray ray;
+		float max_t;
+		DirectX::XMFLOAT3 diffuse_lit;
+		DirectX::XMFLOAT3 diffuse_shadowed;
+		DirectX::XMFLOAT3 specular;
+	};
+
+
 	template<typename VB, typename RT>
 	class raytracer
 	{
@@ -102,21 +144,116 @@ namespace cg::renderer
 
 		void clear_render_target();
 
+		// Convert averaged HDR frames into the render target
+		void resolve_accumulation();
+
+		// Optional albedo, normal and depth of primary hits averaged over all frames like the colour
+		void set_feature_targets(feature_buffers in_features);
+
+		// Filter averaged frames guided by the features, done before they are resolved
+		void denoise_accumulation(unsigned iterations);
+
 		void set_viewport(size_t in_width, size_t in_height);
 
 		void set_camera(std::shared_ptr<world::camera> in_camera);
 
+		// Without scheduler the frame is rendered on the calling thread
+		void set_scheduler(std::shared_ptr<utils::tile_scheduler> in_scheduler);
+
+		// Optional per-pixel traversal cost summed over all frames, used for the heatmap
+		void set_traversal_cost_target(std::shared_ptr<resource<float>> in_traversal_cost);
+
+		// Statistics of all frames rendered since the render target was set
+		const render_stats& get_stats() const;
+
 		void set_vertex_buffers(std::vector<std::shared_ptr<resource<VB>>> in_vertex_buffers);
 
 		void set_index_buffers(std::vector<std::shared_ptr<resource<unsigned int>>> in_index_buffers);
 
 		void build_acceleration_structure();
 
+		// Gather triangles of the hierarchy into records read by traversal, and emissive ones into lights.
+		// Done by build and load of the acceleration structure
+		void build_triangle_records();
+
+		// Traverse binary hierarchy (2) or the 4-wide one collapsed from it (4).
+		// Has to be set before the acceleration structure is built or loaded
+		void set_bvh_width(unsigned in_bvh_width);
+
+		// Trace primary rays of 2x2 pixel blocks as packets
+		void set_packet_tracing(bool in_packet_tracing);
+
+		// Number of rays traced along a path: the primary one and its bounces
+		void set_raytracing_depth(unsigned in_raytracing_depth);
+
+		// Rays of all kinds traced for a pixel in one frame, bounces stop before they would exceed it.
+		// The primary ray and its shadow rays are always traced
+		void set_ray_budget(unsigned in_ray_budget);
+
+		// Points sampled on emissive triangles for every hit. Scenes without emissive materials
+		// are lit by the default point light
+		void set_light_samples(unsigned in_light_samples);
+
+		// Pick emissive triangles by their importance to the hit through the light hierarchy,
+		// instead of by power alone
+		void set_light_tree(bool in_light_tree);
+
+		// Direct light of primary hits comes from per-pixel reservoirs reused across frames and neighbours,
+		// one shadow ray per pixel. Needs emissive triangles, takes precedence over packets and wavefront
+		void set_light_reuse(bool in_light_reuse, unsigned in_reuse_candidates);
+
+		// Run every stage of the pipeline for all rays of a tile before the next stage
+		void set_wavefront(bool in_wavefront);
+
+		// Cache of the acceleration structure, key has to identify the geometry it was built for
+		bool load_acceleration_structure(const std::filesystem::path& path, uint64_t key);
+		void save_acceleration_structure(const std::filesystem::path& path, uint64_t key) const;
+
 		void launch_ray_generation(size_t frame_id);
 
-		bool trace_ray(const ray& ray, float max_t, float min_t, payload& payload, bool bIsShadowRay = false) const;
+		// Find the closest intersection and interpolate its attributes
+		bool closest_hit(const ray& ray, float max_t, float min_t, payload& payload) const;
+
+		// Stop at the first intersection found, no attributes are computed
+		bool any_hit(const ray& ray, float max_t, float min_t) const;
+
+		// Trace four rays together through the binary hierarchy, returns mask of the rays that hit.
+		// Rays pointing into different octants are traced one by one with closest_hit
+		int closest_hit_packet(const std::array<ray, 4>& rays, float max_t, float min_t,
+							   std::array<payload, 4>& payloads) const;
+
+		DirectX::XMVECTOR hit_shader(const payload& p, const ray& camera_ray, sampler& rng) const;
+
+		light_sample sample_light(const payload& p, const ray& camera_ray, const light& l) const;
+
+		// Call back with every light sample of the hit
+		template<typename F>
+		void sample_lights(const payload& p, const ray& camera_ray, sampler& rng, F&& callback) const;
+
+		// Upper bound of shadow rays traced for a hit
+		size_t get_num_light_samples() const;
 
-		DirectX::XMVECTOR hit_shader(const payload& p, const ray& camera_ray) const;
+		// Pick a point on an emissive triangle for the hit
+		emitter_sample sample_emitter(const payload& p, sampler& rng) const;
+
+		// Emissive point as a point light seen from the address, its intensity is scaled by scale.
+		// Ambient light and the share of specular are those of the default light
+		light get_emitter_light(DirectX::FXMVECTOR address, DirectX::FXMVECTOR position, DirectX::FXMVECTOR normal,
+								DirectX::GXMVECTOR emission, float scale, float ambient_scale) const;
+
+		// Unshadowed direct light of the sample at the hit, reduced to luminance
+		float get_reuse_target(const payload& p, const ray& camera_ray, const reservoir_sample& sample) const;
+
+		// Ambient and direct light of the sample kept by the reservoir with one shadow ray
+		DirectX::XMVECTOR shade_reservoir(const reservoir& r, const payload& p, const ray& camera_ray) const;
+
+		// Continue the path after a hit by sampling the diffuse or the mirror lobe. Returns false when the path ends,
+		// otherwise scales throughput by the reflectance of the surface and reports whether the mirror was sampled
+		bool bounce_shader(const payload& p, const ray& incoming, sampler& rng,
+						   DirectX::XMVECTOR& throughput, DirectX::XMVECTOR& next_direction, bool& is_specular) const;
+
+		// Randomly end paths of low throughput from the second bounce on, survivors are scaled up
+		static bool russian_roulette(unsigned depth, sampler& rng, DirectX::XMVECTOR& throughput);
 
 		DirectX::XMVECTOR miss_shader(const payload& p, const ray& camera_ray) const;
 
@@ -128,14 +265,70 @@ namespace cg::renderer
 
 		static DirectX::XMFLOAT2 get_jitter(size_t frame_id);
 
+		DirectX::XMVECTOR get_background_color(size_t x, size_t y) const;
+
 	protected:
+		// Moller-Trumbore test, u and v are barycentric coordinates of vertices 1 and 2
+		bool intersect_triangle(const ray& ray, const triangle_record& triangle, float min_t, float max_t,
+								float& t, float& u, float& v) const;
+
+		payload interpolate_hit(const triangle_record& triangle, float t, float u, float v) const;
+
+		// Random numbers of the bounce at given depth of the path through the pixel.
+		// Other streams serve passes that are not a part of the path
+		sampler get_path_sampler(size_t x, size_t y, size_t frame_id, unsigned depth, unsigned stream = 0) const;
+
+		// Rays are grouped by direction octant, then by origin along a Morton curve
+		uint32_t get_sort_key(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction) const;
+
+		// Trace paths of all pixels of the tile stage by stage, radiance is written per tile pixel
+		template<typename F, typename G>
+		void trace_tile_wavefront(const utils::tile& tile, size_t frame_id, F&& make_primary_ray, G&& store_primary_hit,
+								  float min_t, float max_t, std::vector<DirectX::XMFLOAT3>& radiance) const;
+
 		std::shared_ptr<resource<RT>> render_target;
-		std::shared_ptr<resource<RT>> history;
+		std::shared_ptr<resource<color>> accumulation;
+		feature_buffers features;
 		std::vector<std::shared_ptr<resource<unsigned int>>> index_buffers;
 		std::vector<std::shared_ptr<resource<VB>>> vertex_buffers;
-		std::vector<DirectX::BoundingBox> acceleration_structures;
+		bvh acceleration_structure;
+		bvh4 wide_acceleration_structure;
+		std::vector<triangle_record> triangles;
+		unsigned bvh_width = 2;
+		bool packet_tracing = false;
+		unsigned raytracing_depth = 1;
+		unsigned ray_budget = 64;
+		unsigned light_samples = 1;
+		bool light_tree = false;
+		bool light_reuse = false;
+		unsigned reuse_candidates = 8;
+		bool wavefront = false;
+
+		std::vector<light> lights =
+		{
+			{
+				DirectX::XMVectorSet(0.0f, 1.925f, 0.0f, 1.0f),
+				DirectX::XMVectorSet(0.25f, 0.25f, 0.25f, 1.0f),
+				DirectX::XMVectorSet(0.75f, 0.75f, 0.75f, 1.0f),
+				DirectX::XMVectorSet(0.4f, 0.4f, 0.4f, 1.0f)
+			}
+		};
+
+		emissive_lights emitters;
+
+		// Primary hits of the frame and reservoirs of light reuse, one per pixel.
+		// History holds the final reservoirs of the previous frame
+		std::vector<payload> primary_hits;
+		std::vector<char> primary_hit_flags;
+		std::vector<reservoir> reservoirs;
+		std::vector<reservoir> reservoir_history;
 
 		std::shared_ptr<world::camera> camera;
+		std::shared_ptr<utils::tile_scheduler> scheduler;
+
+		std::shared_ptr<resource<float>> traversal_cost;
+		render_stats stats;
+		std::mutex stats_mutex;
 
 		size_t width = 1920;
 		size_t height = 1080;
@@ -147,8 +340,10 @@ namespace cg::renderer
 		std::shared_ptr<resource<RT>> in_render_target)
 	{
 		render_target = in_render_target;
-		// make history buffer same format and size as render target
-		history = std::make_shared<resource<RT>>(width, height);
+		// frames are averaged in float precision and resolved to render target format once
+		accumulation = std::make_shared<resource<color>>(width, height);
+		stats.reset(width, height);
+		reservoir_history.assign(width * height, reservoir{});
 	}
 
 	template<typename VB, typename RT>
@@ -161,16 +356,36 @@ namespace cg::renderer
 			{
 				for (size_t x = 0; x != width; ++x)
 				{
-					render_target->item(x, y) = unsigned_color::from_float3({
-						static_cast<float>(x) / width,
-						static_cast<float>(y) / height,
-						1.0
-					});
+					render_target->item(x, y) = unsigned_color::from_xmvector(get_background_color(x, y));
 				}
 			}
 		}
 	}
 
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::resolve_accumulation()
+	{
+		for (size_t y = 0; y != height; ++y)
+		{
+			for (size_t x = 0; x != width; ++x)
+			{
+				render_target->item(x, y) = unsigned_color::from_color(accumulation->item(x, y));
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_feature_targets(feature_buffers in_features)
+	{
+		features = in_features;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::denoise_accumulation(unsigned iterations)
+	{
+		denoise(*accumulation, features, iterations, scheduler.get());
+	}
+
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<resource<unsigned int>>> in_index_buffers)
 	{
@@ -185,20 +400,158 @@ namespace cg::renderer
 
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::build_acceleration_structure()
+	{
+		// Single hierarchy over triangles of all shapes
+		acceleration_structure.build(vertex_buffers, index_buffers);
+		build_triangle_records();
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_bvh_width(unsigned in_bvh_width)
+	{
+		if (in_bvh_width != 2 && in_bvh_width != bvh4::width)
+		{
+			THROW_ERROR("Unsupported BVH width " + std::to_string(in_bvh_width));
+		}
+		bvh_width = in_bvh_width;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_packet_tracing(bool in_packet_tracing)
+	{
+		packet_tracing = in_packet_tracing;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_raytracing_depth(unsigned in_raytracing_depth)
+	{
+		raytracing_depth = std::max(1u, in_raytracing_depth);
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_ray_budget(unsigned in_ray_budget)
+	{
+		ray_budget = in_ray_budget;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_light_samples(unsigned in_light_samples)
+	{
+		light_samples = std::max(1u, in_light_samples);
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_light_tree(bool in_light_tree)
+	{
+		light_tree = in_light_tree;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_light_reuse(bool in_light_reuse, unsigned in_reuse_candidates)
+	{
+		light_reuse = in_light_reuse;
+		reuse_candidates = std::max(1u, in_reuse_candidates);
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_wavefront(bool in_wavefront)
+	{
+		wavefront = in_wavefront;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::build_triangle_records()
 	{
 		using namespace DirectX;
-		acceleration_structures.clear();
-		acceleration_structures.reserve(vertex_buffers.size());
+		const bvh_primitive* primitives = acceleration_structure.get_primitives();
+		triangles.resize(acceleration_structure.get_num_primitives());
+		std::vector<emissive_triangle> emissiveTriangles;
+		for (size_t i = 0; i != triangles.size(); ++i)
+		{
+			const bvh_primitive& primitive = primitives[i];
+			XMVECTOR positions[3];
+			XMVECTOR emission = XMVectorZero();
+			for (size_t j = 0; j != 3; ++j)
+			{
+				const unsigned index = index_buffers[primitive.shape_id]->item(3 * primitive.primitive_id + j);
+				positions[j] = XMLoadFloat3(&vertex_buffers[primitive.shape_id]->item(index).position);
+				emission = XMVectorAdd(emission, XMLoadFloat3(&vertex_buffers[primitive.shape_id]->item(index).emissive));
+			}
+
+			triangle_record& triangle = triangles[i];
+			const XMVECTOR edge1 = XMVectorSubtract(positions[1], positions[0]);
+			const XMVECTOR edge2 = XMVectorSubtract(positions[2], positions[0]);
+			XMStoreFloat3(&triangle.v0, positions[0]);
+			XMStoreFloat3(&triangle.edge1, edge1);
+			XMStoreFloat3(&triangle.edge2, edge2);
+			XMStoreFloat3(&triangle.normal, XMVector3Normalize(XMVector3Cross(edge2, edge1)));
+			triangle.shape_id = primitive.shape_id;
+			triangle.primitive_id = primitive.primitive_id;
+			triangle.padding0 = 0.0f;
+			triangle.padding1 = 0.0f;
+
+			// Emission comes from the material, so it is the same for all vertices
+			emission = XMVectorScale(emission, 1.0f / 3.0f);
+			const float luminance = XMVectorGetX(XMVector3Dot(emission, XMVectorSet(0.2126f, 0.7152f, 0.0722f, 0.0f)));
+			const float area = 0.5f * XMVectorGetX(XMTriangleAreaTwice(edge1, edge2));
+			if (luminance > 0.0f && area > 0.0f)
+			{
+				emissive_triangle& emitter = emissiveTriangles.emplace_back();
+				emitter.v0 = triangle.v0;
+				emitter.edge1 = triangle.edge1;
+				emitter.edge2 = triangle.edge2;
+				emitter.normal = triangle.normal;
+				XMStoreFloat3(&emitter.emission, emission);
+				emitter.area = area;
+				emitter.power = luminance * area;
+			}
+		}
+		emitters.build(std::move(emissiveTriangles));
+
+		// Wide hierarchy refers to the records, so it is rebuilt with them
+		if (bvh_width == bvh4::width)
+		{
+			wide_acceleration_structure.build(acceleration_structure, triangles);
+		}
+	}
 
-		for (std::shared_ptr<resource<VB>>& vb : vertex_buffers)
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::load_acceleration_structure(const std::filesystem::path& path, uint64_t key)
+	{
+		if (!acceleration_structure.load(path, key))
 		{
-			// Extract positions of vertices from VB to build AABB for each one
-			acceleration_structures.emplace_back();
-			BoundingBox::CreateFromPoints(acceleration_structures.back(),
-										  vb->get_number_of_elements(),
-										  &vb->item(0).position,
-										  sizeof(VB));
+			return false;
+		}
+
+		// Guard against a hierarchy built from the same file by a different loader
+		size_t numFaces = 0;
+		for (const auto& ib : index_buffers)
+		{
+			numFaces += ib->get_number_of_elements() / 3;
+		}
+		if (acceleration_structure.get_num_primitives() != numFaces)
+		{
+			return false;
+		}
+		// Primitives are dereferenced when records are built, stale or corrupt ones would read out of bounds
+		const bvh_primitive* primitives = acceleration_structure.get_primitives();
+		for (size_t i = 0; i != acceleration_structure.get_num_primitives(); ++i)
+		{
+			const bvh_primitive& primitive = primitives[i];
+			if (primitive.shape_id >= index_buffers.size() ||
+				primitive.primitive_id >= index_buffers[primitive.shape_id]->get_number_of_elements() / 3)
+			{
+				return false;
+			}
 		}
+		build_triangle_records();
+		return true;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::save_acceleration_structure(const std::filesystem::path& path, uint64_t key) const
+	{
+		acceleration_structure.save(path, key);
 	}
 
 	template<typename VB, typename RT>
@@ -214,10 +567,29 @@ namespace cg::renderer
 		camera = in_camera;
 	}
 
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_scheduler(std::shared_ptr<utils::tile_scheduler> in_scheduler)
+	{
+		scheduler = in_scheduler;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_traversal_cost_target(std::shared_ptr<resource<float>> in_traversal_cost)
+	{
+		traversal_cost = in_traversal_cost;
+	}
+
+	template<typename VB, typename RT>
+	const render_stats& raytracer<VB, RT>::get_stats() const
+	{
+		return stats;
+	}
+
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::launch_ray_generation(size_t frame_id)
 	{
 		using namespace DirectX;
+		const auto frameStart = std::chrono::steady_clock::now();
 
 		const float h = static_cast<float>(height);
 		const float w = static_cast<float>(width);
@@ -233,242 +605,1035 @@ namespace cg::renderer
 		jitter.y = (jitter.y * 2.0f - 1.0f) / h * 2;
 		projection.r[2] = XMVectorAdd(projection.r[2], XMLoadFloat2(&jitter));
 
-		for (size_t y = 0; y != height; ++y)
-		{
-			for (size_t x = 0; x != width; ++x)
+		auto make_primary_ray = [&](size_t x, size_t y) {
+			const float fx = static_cast<float>(x);
+			const float fy = static_cast<float>(y);
+			const XMVECTOR pixel = XMVectorSet(fx, fy, 1.0f, 0.0f);
+			// Transform pixel point from screen space into world space far frustum plane
+			XMVECTOR pixelDir = XMVector3Normalize(XMVector3Unproject(pixel,
+																	  0.0f, 0.0f, w, h,
+																	  0.0f, 1.0f,
+																	  projection,
+																	  view,
+																	  XMMatrixIdentity()));
+			// main camera ray
+			return ray(eye, pixelDir);
+		};
+
+		// progressive average of all frames for TAA, kept in float to avoid banding
+		auto accumulate = [&](size_t x, size_t y, FXMVECTOR current_color) {
+			color& accumulated = accumulation->item(x, y);
+			if (frame_id > 0) // skip 1st frame, because there is no history at this moment
+			{
+				const float weight = 1.0f / static_cast<float>(frame_id + 1);
+				accumulated = color::from_xmvector(XMVectorLerp(accumulated.to_xmvector(), current_color, weight));
+			}
+			else
+			{
+				accumulated = color::from_xmvector(current_color);
+			}
+		};
+
+		// Features are averaged the same way as colour, so they match it at edges smoothed by jitter
+		auto store_features = [&](size_t x, size_t y, bool bHit, const payload& p) {
+			if (!features.albedo)
+			{
+				return;
+			}
+			const XMVECTOR albedo = bHit ? XMLoadFloat3(&p.point.diffuse) : XMVectorZero();
+			const XMVECTOR normal = bHit ? XMLoadFloat3(&p.point.normal) : XMVectorZero();
+			const float depth = bHit ? p.depth : 0.0f;
+			if (frame_id > 0)
+			{
+				const float weight = 1.0f / static_cast<float>(frame_id + 1);
+				features.albedo->item(x, y) = color::from_xmvector(XMVectorLerp(features.albedo->item(x, y).to_xmvector(), albedo, weight));
+				features.normal->item(x, y) = color::from_xmvector(XMVectorLerp(features.normal->item(x, y).to_xmvector(), normal, weight));
+				features.depth->item(x, y) += (depth - features.depth->item(x, y)) * weight;
+			}
+			else
+			{
+				features.albedo->item(x, y) = color::from_xmvector(albedo);
+				features.normal->item(x, y) = color::from_xmvector(normal);
+				features.depth->item(x, y) = depth;
+			}
+		};
+
+		const bool bReuseLights = light_reuse && !emitters.empty();
+
+		// Shade traced primary ray and follow its bounces, trace_cost is the part of traversal cost spent on it
+		auto shade_pixel = [&](size_t x, size_t y, const ray& r, bool bHit, const payload& p, float trace_cost) {
+			trace_counters& counters = thread_counters;
+			const uint64_t costBefore = counters.get_cost();
+			const uint64_t raysBefore = counters.shadow_rays + counters.bounce_rays;
+			store_features(x, y, bHit, p);
+
+			sampler rng = get_path_sampler(x, y, frame_id, 0);
+			XMVECTOR current_color;
+			if (bHit) // hit object
+			{
+				// Light sources are seen by the camera and mirror reflections, diffuse bounces reach them by light sampling
+				const XMVECTOR directColor = bReuseLights ? shade_reservoir(reservoir_history[y * width + x], p, r)
+														  : hit_shader(p, r, rng);
+				current_color = XMVectorAdd(directColor, XMLoadFloat3(&p.point.emissive));
+			}
+			else // miss object
+			{
+				current_color = miss_shader(p, r);
+				// don't overwrite my beautiful background gradient
+				if (XMVectorGetX(XMVector3Length(current_color)) <= 0)
+				{
+					current_color = get_background_color(x, y);
+				}
+			}
+
+			XMVECTOR throughput = XMVectorSplatOne();
+			ray current = r;
+			payload currentHit = p;
+			XMVECTOR direction;
+			bool bIsSpecular;
+			for (unsigned depth = 1; bHit && depth < raytracing_depth; ++depth)
+			{
+				// The bounce may need a shadow ray per light besides itself
+				const uint64_t raysUsed = 1 + counters.shadow_rays + counters.bounce_rays - raysBefore;
+				if (raysUsed + 1 + get_num_light_samples() > ray_budget)
+				{
+					break;
+				}
+				if (!bounce_shader(currentHit, current, rng, throughput, direction, bIsSpecular) ||
+					!russian_roulette(depth, rng, throughput))
+				{
+					break;
+				}
+				current = ray(XMLoadFloat3(&currentHit.point.position), direction);
+				++counters.bounce_rays;
+				bHit = closest_hit(current, maxZ, 0.0001f, currentHit);
+				rng = get_path_sampler(x, y, frame_id, depth);
+				XMVECTOR bounceColor = bHit ? hit_shader(currentHit, current, rng) : miss_shader(currentHit, current);
+				if (bHit && bIsSpecular)
+				{
+					bounceColor = XMVectorAdd(bounceColor, XMLoadFloat3(&currentHit.point.emissive));
+				}
+				current_color = XMVectorAdd(current_color, XMColorModulate(throughput, bounceColor));
+			}
+
+			accumulate(x, y, current_color);
+
+			if (traversal_cost)
+			{
+				traversal_cost->item(x, y) += trace_cost + static_cast<float>(counters.get_cost() - costBefore);
+			}
+		};
+
+		auto render_pixel = [&](size_t x, size_t y) {
+			trace_counters& counters = thread_counters;
+			const uint64_t costBefore = counters.get_cost();
+			++counters.primary_rays;
+			const ray r = make_primary_ray(x, y);
+			payload p;
+			const bool bHit = closest_hit(r, maxZ, minZ, p);
+			shade_pixel(x, y, r, bHit, p, static_cast<float>(counters.get_cost() - costBefore));
+		};
+
+		// 2x2 pixel blocks are traced as one packet, the cost of the packet is shared between them
+		auto render_block = [&](size_t x, size_t y) {
+			trace_counters& counters = thread_counters;
+			const uint64_t costBefore = counters.get_cost();
+			counters.primary_rays += 4;
+			const std::array<ray, 4> rays{make_primary_ray(x, y), make_primary_ray(x + 1, y),
+										  make_primary_ray(x, y + 1), make_primary_ray(x + 1, y + 1)};
+			std::array<payload, 4> payloads;
+			const int hitMask = closest_hit_packet(rays, maxZ, minZ, payloads);
+			const float traceCost = static_cast<float>(counters.get_cost() - costBefore) / rays.size();
+			for (size_t lane = 0; lane != rays.size(); ++lane)
+			{
+				shade_pixel(x + lane % 2, y + lane / 2, rays[lane], (hitMask & (1 << lane)) != 0, payloads[lane], traceCost);
+			}
+		};
+
+		// Every pixel only touches its own accumulation texel,
+		// so tiles are independent and the result doesn't depend on their order
+		auto render_tile = [&](const utils::tile& tile) {
+			trace_counters& counters = thread_counters;
+			counters = {};
+			size_t y = tile.y_begin;
+			if (wavefront)
 			{
-				const float fx = static_cast<float>(x);
-				const float fy = static_cast<float>(y);
-				const XMVECTOR pixel = XMVectorSet(fx, fy, 1.0f, 0.0f);
-				// Transform pixel point from screen space into world space far frustum plane
-				XMVECTOR pixelDir = XMVector3Normalize(XMVector3Unproject(pixel,
-																		  0.0f, 0.0f, w, h,
-																		  0.0f, 1.0f,
-																		  projection,
-																		  view,
-																		  XMMatrixIdentity()));
-				// main camera ray
-				ray r(eye, pixelDir);
-
-				payload p;
-				if (trace_ray(r, maxZ, minZ, p)) // hit object
+				static thread_local std::vector<XMFLOAT3> radiance;
+				trace_tile_wavefront(tile, frame_id, make_primary_ray, store_features, minZ, maxZ, radiance);
+				const size_t tileWidth = tile.x_end - tile.x_begin;
+				for (; y != tile.y_end; ++y)
 				{
-					const XMVECTOR output = hit_shader(p, r);
-					render_target->item(x, y) = unsigned_color::from_xmvector(output);
+					for (size_t x = tile.x_begin; x != tile.x_end; ++x)
+					{
+						accumulate(x, y, XMLoadFloat3(&radiance[(y - tile.y_begin) * tileWidth + x - tile.x_begin]));
+					}
 				}
-				else // miss object
+			}
+			else if (packet_tracing)
+			{
+				// Odd row and column at the tile border are traced ray by ray
+				for (; y + 1 < tile.y_end; y += 2)
 				{
-					const XMVECTOR output = miss_shader(p, r);
-					// don't overwrite my beautiful background gradient
-					if (XMVectorGetX(XMVector3Length(output)) > 0)
+					size_t x = tile.x_begin;
+					for (; x + 1 < tile.x_end; x += 2)
+					{
+						render_block(x, y);
+					}
+					if (x != tile.x_end)
 					{
-						render_target->item(x, y) = unsigned_color::from_xmvector(output);
+						render_pixel(x, y);
+						render_pixel(x, y + 1);
 					}
 				}
+			}
+			for (; y != tile.y_end; ++y)
+			{
+				for (size_t x = tile.x_begin; x != tile.x_end; ++x)
+				{
+					render_pixel(x, y);
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			stats.counters += counters;
+		};
 
-				// perform resolution with history buffer for TAA
-				XMVECTOR current_color = render_target->item(x, y).to_xmvector();
-				const XMVECTOR history_color = history->item(x, y).to_xmvector();
-				if (frame_id > 0) // skip 1st frame, because there is no history at this moment
+		// Light reuse, first pass: trace primary rays, pick a sample from fresh candidates
+		// and merge the reservoir of the previous frame. Camera doesn't move between accumulated frames,
+		// so the history of a pixel is the one at the same position
+		auto resample_tile = [&](const utils::tile& tile) {
+			trace_counters& counters = thread_counters;
+			counters = {};
+			for (size_t y = tile.y_begin; y != tile.y_end; ++y)
+			{
+				for (size_t x = tile.x_begin; x != tile.x_end; ++x)
 				{
-					constexpr float mix_factor = 0.75f;
-					current_color = XMVectorLerp(current_color, history_color, mix_factor);
+					const size_t pixel = y * width + x;
+					const uint64_t costBefore = counters.get_cost();
+					++counters.primary_rays;
+					const ray r = make_primary_ray(x, y);
+					payload& p = primary_hits[pixel];
+					primary_hit_flags[pixel] = closest_hit(r, maxZ, minZ, p);
+					if (traversal_cost)
+					{
+						traversal_cost->item(x, y) += static_cast<float>(counters.get_cost() - costBefore);
+					}
+
+					reservoir& current = reservoirs[pixel];
+					current = {};
+					if (!primary_hit_flags[pixel])
+					{
+						continue;
+					}
+
+					sampler rng = get_path_sampler(x, y, frame_id, 0, 1);
+					for (unsigned i = 0; i != reuse_candidates; ++i)
+					{
+						const emitter_sample emitter = sample_emitter(p, rng);
+						reservoir_sample candidate;
+						XMStoreFloat3(&candidate.position, emitter.position);
+						XMStoreFloat3(&candidate.normal, emitter.normal);
+						XMStoreFloat3(&candidate.emission, emitter.emission);
+						const float target = get_reuse_target(p, r, candidate);
+						current.update(candidate, target, target / emitter.pdf, 1.0f, rng.next_float());
+					}
+					current.finalize();
+
+					// Long history would stop the reservoir from following changes in the scene
+					const reservoir& history = reservoir_history[pixel];
+					if (history.m > 0.0f)
+					{
+						const float m = std::min(history.m, 20.0f * current.m);
+						const float target = get_reuse_target(p, r, history.sample);
+						current.update(history.sample, target, target * history.contribution_weight * m, m, rng.next_float());
+						current.finalize();
+					}
+				}
+			}
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			stats.counters += counters;
+		};
+
+		// Light reuse, second pass: merge reservoirs of similar neighbours and shade.
+		// Neighbours are read from the first pass, so tiles stay independent
+		auto reuse_tile = [&](const utils::tile& tile) {
+			trace_counters& counters = thread_counters;
+			counters = {};
+			constexpr unsigned numNeighbours = 4;
+			constexpr float radius = 16.0f;
+			for (size_t y = tile.y_begin; y != tile.y_end; ++y)
+			{
+				for (size_t x = tile.x_begin; x != tile.x_end; ++x)
+				{
+					const size_t pixel = y * width + x;
+					const payload& p = primary_hits[pixel];
+					const ray r = make_primary_ray(x, y);
+					reservoir& result = reservoir_history[pixel];
+					result = reservoirs[pixel];
+					if (primary_hit_flags[pixel])
+					{
+						sampler rng = get_path_sampler(x, y, frame_id, 0, 2);
+						const XMVECTOR surfaceNormal = XMLoadFloat3(&p.point.normal);
+						for (unsigned i = 0; i != numNeighbours; ++i)
+						{
+							const float angle = XM_2PI * rng.next_float();
+							const float distance = radius * std::sqrt(rng.next_float());
+							const float u = rng.next_float();
+							const long nx = static_cast<long>(x) + std::lround(distance * std::cos(angle));
+							const long ny = static_cast<long>(y) + std::lround(distance * std::sin(angle));
+							if (nx < 0 || ny < 0 || nx >= static_cast<long>(width) || ny >= static_cast<long>(height))
+							{
+								continue;
+							}
+
+							// Samples of other surfaces would bleed light across edges
+							const size_t neighbourPixel = ny * width + nx;
+							const payload& neighbourHit = primary_hits[neighbourPixel];
+							if (neighbourPixel == pixel || !primary_hit_flags[neighbourPixel] ||
+								XMVectorGetX(XMVector3Dot(surfaceNormal, XMLoadFloat3(&neighbourHit.point.normal))) < 0.9f ||
+								std::abs(neighbourHit.depth - p.depth) > 0.1f * p.depth)
+							{
+								continue;
+							}
+
+							const reservoir& neighbour = reservoirs[neighbourPixel];
+							const float target = get_reuse_target(p, r, neighbour.sample);
+							result.update(neighbour.sample, target, target * neighbour.contribution_weight * neighbour.m,
+										  neighbour.m, u);
+						}
+						result.finalize();
+					}
+					shade_pixel(x, y, r, primary_hit_flags[pixel], p, 0.0f);
 				}
-				render_target->item(x, y) = unsigned_color::from_xmvector(current_color);
-				history->item(x, y) = unsigned_color::from_xmvector(current_color);
 			}
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			stats.counters += counters;
+		};
+
+		auto run = [&](auto& tile_function) {
+			if (scheduler)
+			{
+				scheduler->run(width, height, tile_function);
+			}
+			else
+			{
+				tile_function({0, 0, width, height});
+			}
+		};
+
+		if (bReuseLights)
+		{
+			primary_hits.resize(width * height);
+			primary_hit_flags.resize(width * height);
+			reservoirs.resize(width * height);
+			run(resample_tile);
+			run(reuse_tile);
+		}
+		else
+		{
+			run(render_tile);
 		}
+
+		const std::chrono::duration<double, std::milli> frameTime = std::chrono::steady_clock::now() - frameStart;
+		stats.frame_times_ms.push_back(frameTime.count());
 	}
 
 	template<typename VB, typename RT>
-	bool raytracer<VB, RT>::trace_ray(
-		const ray& ray, float max_t, float min_t, payload& outPayload, const bool bIsShadowRay) const
+	template<typename F, typename G>
+	void raytracer<VB, RT>::trace_tile_wavefront(const utils::tile& tile, size_t frame_id, F&& make_primary_ray,
+												 G&& store_primary_hit, float min_t, float max_t,
+												 std::vector<DirectX::XMFLOAT3>& radiance) const
 	{
 		using namespace DirectX;
-		std::set<payload> hits; // Accumulator of all hits of our ray
+		trace_counters& counters = thread_counters;
+		const size_t tileWidth = tile.x_end - tile.x_begin;
+		radiance.assign(tileWidth * (tile.y_end - tile.y_begin), XMFLOAT3(0.0f, 0.0f, 0.0f));
+
+		// Queues keep their capacity from tile to tile
+		static thread_local std::vector<queued_ray> rays, nextRays;
+		static thread_local std::vector<queued_shadow_ray> shadowRays;
+		static thread_local std::vector<payload> hits;
+		static thread_local std::vector<char> hitFlags;
+		static thread_local std::vector<sampler> samplers;
+		static thread_local std::vector<unsigned> raysUsed;
+		raysUsed.assign(radiance.size(), 1);
+
+		auto to_ray = [](const queued_ray& q) {
+			return ray(XMLoadFloat3(&q.origin), XMLoadFloat3(&q.direction));
+		};
+		auto add_radiance = [&](unsigned pixel, FXMVECTOR throughput, FXMVECTOR value) {
+			XMStoreFloat3(&radiance[pixel], XMVectorAdd(XMLoadFloat3(&radiance[pixel]), XMColorModulate(throughput, value)));
+		};
+		auto add_cost = [&](unsigned pixel, uint64_t cost_before) {
+			if (traversal_cost)
+			{
+				traversal_cost->item(tile.x_begin + pixel % tileWidth, tile.y_begin + pixel / tileWidth) +=
+						static_cast<float>(counters.get_cost() - cost_before);
+			}
+		};
+		auto by_sort_key = [](const auto& a, const auto& b) {
+			return a.sort_key < b.sort_key;
+		};
 
-		for (size_t modelIdx = 0; modelIdx != index_buffers.size(); ++modelIdx)
+		// Generate: primary rays come in scanline order, which is coherent already
+		rays.clear();
+		for (size_t y = tile.y_begin; y != tile.y_end; ++y)
 		{
-			// Acceleration: skip geometry traversal if not intersecting the AABB
-			if (float _; !acceleration_structures[modelIdx].Intersects(ray.position, ray.direction, _))
+			for (size_t x = tile.x_begin; x != tile.x_end; ++x)
 			{
-				continue;
+				const ray r = make_primary_ray(x, y);
+				queued_ray& q = rays.emplace_back();
+				XMStoreFloat3(&q.origin, r.position);
+				XMStoreFloat3(&q.direction, r.direction);
+				q.pixel = static_cast<unsigned>((y - tile.y_begin) * tileWidth + x - tile.x_begin);
+				q.sort_key = 0;
+				q.throughput = XMFLOAT3(1.0f, 1.0f, 1.0f);
+				q.min_t = min_t;
+				q.is_specular = false;
 			}
+		}
+		counters.primary_rays += rays.size();
 
-			const size_t numIndices = index_buffers.at(modelIdx)->get_number_of_elements();
-			const size_t numFaces = numIndices / 3; // faces are all triangles
-
-			for (size_t faceIdx = 0; faceIdx != numFaces; ++faceIdx)
+		for (unsigned depth = 0; !rays.empty(); ++depth)
+		{
+			// Intersect
+			hits.resize(rays.size());
+			hitFlags.resize(rays.size());
+			for (size_t i = 0; i != rays.size(); ++i)
 			{
-				// Extract triangle
-				std::array<vertex, 3> face;
-				std::array<XMVECTOR, 3> triangle;
-				for (size_t i = 0; i != 3; ++i)
+				const uint64_t costBefore = counters.get_cost();
+				hitFlags[i] = closest_hit(to_ray(rays[i]), max_t, rays[i].min_t, hits[i]);
+				add_cost(rays[i].pixel, costBefore);
+				if (depth == 0)
 				{
-					const unsigned index = index_buffers.at(modelIdx)->item(3 * faceIdx + i);
-					face.at(i) = vertex_buffers.at(modelIdx)->item(index);
-					triangle.at(i) = XMLoadFloat3(&face.at(i).position);
+					store_primary_hit(tile.x_begin + rays[i].pixel % tileWidth, tile.y_begin + rays[i].pixel / tileWidth,
+									  hitFlags[i] != 0, hits[i]);
 				}
+			}
 
-				// Calculate normal for lighting
-				const XMVECTOR faceBasisX = XMVectorSubtract(triangle.at(1), triangle.at(0));
-				const XMVECTOR faceBasisY = XMVectorSubtract(triangle.at(2), triangle.at(0));
-				const XMVECTOR normal = XMVector3Normalize(XMVector3Cross(faceBasisY, faceBasisX));
-
-				float t;
-				if (TriangleTests::Intersects(ray.position, ray.direction,
-											  triangle.at(0), triangle.at(1), triangle.at(2),
-											  t))
+			// Shade: misses and ambient light are resolved here, the rest of direct light waits for shadow rays.
+			// Random numbers of a hit are drawn by its light samples first, then by its bounce
+			shadowRays.clear();
+			samplers.clear();
+			for (size_t i = 0; i != rays.size(); ++i)
+			{
+				const queued_ray& q = rays[i];
+				const ray r = to_ray(q);
+				const XMVECTOR throughput = XMLoadFloat3(&q.throughput);
+				sampler& rng = samplers.emplace_back(
+						get_path_sampler(tile.x_begin + q.pixel % tileWidth, tile.y_begin + q.pixel / tileWidth, frame_id, depth));
+				if (!hitFlags[i])
 				{
-					if (t >= min_t && t <= max_t) // limit intersection region
+					XMVECTOR missColor = miss_shader(hits[i], r);
+					// background gradient is seen by the camera only
+					if (depth == 0 && XMVectorGetX(XMVector3Length(missColor)) <= 0)
 					{
-						// For shadow rays we are not interested in intersection detail
-						// Only the fact that there is at least one is enough
-						if (bIsShadowRay)
-						{
-							outPayload.depth = t;
-							return true;
-						}
+						missColor = get_background_color(tile.x_begin + q.pixel % tileWidth, tile.y_begin + q.pixel / tileWidth);
+					}
+					add_radiance(q.pixel, throughput, missColor);
+					continue;
+				}
 
-						// Find intersection point and its barycentric coordinates for interpolation
-						const XMVECTOR hitPoint = XMVectorAdd(ray.position, XMVectorScale(ray.direction, t));
-						const XMVECTOR barycentric = XMFindBarycentric(hitPoint, triangle.at(0), triangle.at(1),
-																	   triangle.at(2));
+				// Emitters are seen by the camera and mirror reflections, the rest reaches them by light sampling
+				if (depth == 0 || q.is_specular)
+				{
+					add_radiance(q.pixel, throughput, XMLoadFloat3(&hits[i].point.emissive));
+				}
+				sample_lights(hits[i], r, rng, [&](const light_sample& sample) {
+					add_radiance(q.pixel, throughput, sample.ambient);
+					if (!sample.bFacesLight)
+					{
+						return;
+					}
 
-						assert(std::abs(XMVectorGetX(XMVectorSum(barycentric)) - 1.0f) < 0.001f);
+					++raysUsed[q.pixel];
+					queued_shadow_ray& shadow = shadowRays.emplace_back();
+					XMStoreFloat3(&shadow.ray.origin, sample.shadow_ray.position);
+					XMStoreFloat3(&shadow.ray.direction, sample.shadow_ray.direction);
+					shadow.ray.pixel = q.pixel;
+					shadow.ray.sort_key = get_sort_key(sample.shadow_ray.position, sample.shadow_ray.direction);
+					shadow.ray.throughput = q.throughput;
+					shadow.ray.min_t = 0.0001f;
+					shadow.ray.is_specular = false;
+					shadow.max_t = sample.distance;
+					XMStoreFloat3(&shadow.diffuse_lit, sample.diffuse_lit);
+					XMStoreFloat3(&shadow.diffuse_shadowed, sample.diffuse_shadowed);
+					XMStoreFloat3(&shadow.specular, sample.specular);
+				});
+			}
 
-						payload hit;
-						hit.depth = t;
-						// Interpolate hit point
-						hit.point = face.at(0) * XMVectorGetX(barycentric)
-							+ face.at(1) * XMVectorGetY(barycentric)
-							+ face.at(2) * XMVectorGetZ(barycentric);
+			// Shadow
+			std::sort(shadowRays.begin(), shadowRays.end(), [&](const queued_shadow_ray& a, const queued_shadow_ray& b) {
+				return by_sort_key(a.ray, b.ray);
+			});
+			for (const queued_shadow_ray& shadow : shadowRays)
+			{
+				const uint64_t costBefore = counters.get_cost();
+				const bool bIsShadow = any_hit(to_ray(shadow.ray), shadow.max_t, shadow.ray.min_t);
+				add_cost(shadow.ray.pixel, costBefore);
 
-						XMStoreFloat3(&hit.point.normal, normal);
+				const XMVECTOR throughput = XMLoadFloat3(&shadow.ray.throughput);
+				add_radiance(shadow.ray.pixel, throughput, XMLoadFloat3(bIsShadow ? &shadow.diffuse_shadowed : &shadow.diffuse_lit));
+				if (!bIsShadow) // Shadowed areas are not shiny
+				{
+					add_radiance(shadow.ray.pixel, throughput, XMLoadFloat3(&shadow.specular));
+				}
+			}
 
-						// Register hit
-						hits.insert(hit);
+			// Bounce
+			nextRays.clear();
+			if (depth + 1 < raytracing_depth)
+			{
+				for (size_t i = 0; i != rays.size(); ++i)
+				{
+					const unsigned pixel = rays[i].pixel;
+					// The bounce may need a shadow ray per light besides itself
+					if (!hitFlags[i] || raysUsed[pixel] + 1 + get_num_light_samples() > ray_budget)
+					{
+						continue;
 					}
+					XMVECTOR throughput = XMLoadFloat3(&rays[i].throughput);
+					XMVECTOR direction;
+					bool bIsSpecular;
+					if (!bounce_shader(hits[i], to_ray(rays[i]), samplers[i], throughput, direction, bIsSpecular) ||
+						!russian_roulette(depth + 1, samplers[i], throughput))
+					{
+						continue;
+					}
+					++raysUsed[pixel];
+
+					const XMVECTOR origin = XMLoadFloat3(&hits[i].point.position);
+					direction = XMVector3Normalize(direction);
+					queued_ray& next = nextRays.emplace_back();
+					XMStoreFloat3(&next.origin, origin);
+					XMStoreFloat3(&next.direction, direction);
+					next.pixel = pixel;
+					next.sort_key = get_sort_key(origin, direction);
+					XMStoreFloat3(&next.throughput, throughput);
+					next.min_t = 0.0001f;
+					next.is_specular = bIsSpecular;
 				}
+				counters.bounce_rays += nextRays.size();
+				std::sort(nextRays.begin(), nextRays.end(), by_sort_key);
+			}
+			std::swap(rays, nextRays);
+		}
+	}
+
+	template<typename VB, typename RT>
+	sampler raytracer<VB, RT>::get_path_sampler(size_t x, size_t y, size_t frame_id, unsigned depth, unsigned stream) const
+	{
+		return sampler(y * width + x, static_cast<uint64_t>(frame_id) << 32 | stream << 16 | depth);
+	}
+
+	template<typename VB, typename RT>
+	uint32_t raytracer<VB, RT>::get_sort_key(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction) const
+	{
+		using namespace DirectX;
+		// Spread 9 bits of a cell index into every third bit
+		auto spread_bits = [](uint32_t v) {
+			v = (v | (v << 16)) & 0x030000ffu;
+			v = (v | (v << 8)) & 0x0300f00fu;
+			v = (v | (v << 4)) & 0x030c30c3u;
+			v = (v | (v << 2)) & 0x09249249u;
+			return v;
+		};
+
+		// 512 cells along each axis of the scene
+		const aabb bounds = acceleration_structure.get_bounds();
+		const XMVECTOR lower = XMLoadFloat3(&bounds.lower);
+		const XMVECTOR extent = XMVectorMax(XMVectorSubtract(XMLoadFloat3(&bounds.upper), lower), XMVectorReplicate(FLT_EPSILON));
+		const XMVECTOR cell = XMVectorScale(XMVectorSaturate(XMVectorDivide(XMVectorSubtract(origin, lower), extent)), 511.0f);
+		const uint32_t morton = spread_bits(static_cast<uint32_t>(XMVectorGetX(cell))) |
+								spread_bits(static_cast<uint32_t>(XMVectorGetY(cell))) << 1 |
+								spread_bits(static_cast<uint32_t>(XMVectorGetZ(cell))) << 2;
+
+		const uint32_t octant = static_cast<uint32_t>(get_lane_mask(XMVectorLess(direction, XMVectorZero())) & 7);
+		return octant << 27 | morton;
+	}
+
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::closest_hit(const ray& ray, float max_t, float min_t, payload& outPayload) const
+	{
+		trace_counters& counters = thread_counters;
+
+		// Walk the hierarchy front to back, every hit shrinks the search interval,
+		// so only the winner is remembered and nothing else is computed for the rest
+		const triangle_record* closest = nullptr;
+		float closestT = 0.0f, closestU = 0.0f, closestV = 0.0f;
+		if (bvh_width == bvh4::width)
+		{
+			unsigned primitiveIdx;
+			closestT = max_t;
+			if (wide_acceleration_structure.closest_hit(ray.position, ray.direction, min_t, closestT,
+														primitiveIdx, closestU, closestV))
+			{
+				closest = &triangles[primitiveIdx];
 			}
 		}
+		else
+		{
+			acceleration_structure.traverse(ray.position, ray.direction, min_t, max_t, [&](unsigned primitive_idx, float& closest_t) {
+				float t, u, v;
+				if (intersect_triangle(ray, triangles[primitive_idx], min_t, closest_t, t, u, v))
+				{
+					closest = &triangles[primitive_idx];
+					closestT = t;
+					closestU = u;
+					closestV = v;
+					closest_t = t;
+				}
+				return false;
+			});
+		}
 
-		// Return only the closest hit
-		if (!hits.empty())
+		if (!closest)
 		{
-			outPayload = *hits.begin();
+			return false;
 		}
-		return !hits.empty();
+		++counters.hits;
+		outPayload = interpolate_hit(*closest, closestT, closestU, closestV);
+		return true;
 	}
 
 	template<typename VB, typename RT>
-	DirectX::XMVECTOR raytracer<VB, RT>::hit_shader(const payload& p, const ray& camera_ray) const
+	bool raytracer<VB, RT>::any_hit(const ray& ray, float max_t, float min_t) const
 	{
-		// The hit shader is universal for whole scene and uses Phong/Blinn-Phong lighting
+		trace_counters& counters = thread_counters;
+		++counters.shadow_rays;
 
-		using namespace DirectX;
+		bool bHasHit = false;
+		if (bvh_width == bvh4::width)
+		{
+			bHasHit = wide_acceleration_structure.any_hit(ray.position, ray.direction, min_t, max_t);
+		}
+		else
+		{
+			acceleration_structure.traverse(ray.position, ray.direction, min_t, max_t, [&](unsigned primitive_idx, float& closest_t) {
+				float t, u, v;
+				bHasHit = intersect_triangle(ray, triangles[primitive_idx], min_t, closest_t, t, u, v);
+				return bHasHit;
+			});
+		}
 
-		// HINT: Use this switchers to play with parameters and see how lighting is build
-		constexpr bool USE_BLINN_LIGHTING = false;
-		constexpr bool USE_AMBIENT = true;
-		constexpr bool USE_DIFFUSE = true;
-		constexpr bool USE_SPECULAR = true;
+		if (bHasHit)
+		{
+			++counters.hits;
+		}
+		return bHasHit;
+	}
 
-		const std::vector<light> lights =
+	template<typename VB, typename RT>
+	int raytracer<VB, RT>::closest_hit_packet(const std::array<ray, 4>& rays, float max_t, float min_t,
+											  std::array<payload, 4>& payloads) const
+	{
+		using namespace DirectX;
+		// Rays of different octants would disagree on the order of children
+		const int octant = get_lane_mask(XMVectorLess(rays[0].direction, XMVectorZero())) & 7;
+		bool bIsCoherent = true;
+		for (size_t i = 1; i != rays.size(); ++i)
 		{
+			bIsCoherent &= (get_lane_mask(XMVectorLess(rays[i].direction, XMVectorZero())) & 7) == octant;
+		}
+		if (!bIsCoherent)
+		{
+			int hitMask = 0;
+			for (size_t i = 0; i != rays.size(); ++i)
 			{
-				XMVectorSet(0.0f, 1.925f, 0.0f, 1.0f),
-				XMVectorSet(0.25f, 0.25f, 0.25f, 1.0f),
-				XMVectorSet(0.75f, 0.75f, 0.75f, 1.0f),
-				XMVectorSet(0.4f, 0.4f, 0.4f, 1.0f)
+				hitMask |= closest_hit(rays[i], max_t, min_t, payloads[i]) ? 1 << i : 0;
 			}
-		};
+			return hitMask;
+		}
 
-		XMVECTOR output = XMVectorZero();
-		for (const light& l : lights)
+		trace_counters& counters = thread_counters;
+
+		const XMVECTOR origins[] = {rays[0].position, rays[1].position, rays[2].position, rays[3].position};
+		const XMVECTOR directions[] = {rays[0].direction, rays[1].direction, rays[2].direction, rays[3].direction};
+		const ray_packet packet = ray_packet::from_rays(origins, directions);
+		const XMVECTOR minT = XMVectorReplicate(min_t);
+		XMVECTOR closestT = XMVectorReplicate(max_t);
+		XMVECTOR closestU = XMVectorZero();
+		XMVECTOR closestV = XMVectorZero();
+		unsigned closestIdx[4];
+		int hitMask = 0;
+		if (bvh_width == bvh4::width)
 		{
-			const XMVECTOR address = XMLoadFloat3(&p.point.position);
-			const XMVECTOR surfaceNormal = XMLoadFloat3(&p.point.normal);
-			const XMVECTOR lightVector = XMVectorSubtract(l.position, address);
-			const XMVECTOR lightDir = XMVector3Normalize(lightVector);
-			const XMVECTOR incidentDir = XMVectorScale(lightDir, -1.0f);
-			const XMVECTOR reflectedLightDir = XMVector3Reflect(incidentDir, surfaceNormal);
-			const XMVECTOR cameraDir = XMVector3Normalize(XMVectorSubtract(camera_ray.position, address));
-			XMVECTOR shininess = XMVectorReplicate(p.point.shininess);
-			XMVECTOR shadow = XMVectorSplatOne();
+			hitMask = wide_acceleration_structure.closest_hit_packet(packet, minT, closestT, closestIdx, closestU, closestV);
+		}
+		else
+		{
+			acceleration_structure.traverse_packet(packet, minT, closestT, [&](unsigned primitive_idx, int active_mask, XMVECTOR& closest_t) {
+				XMVECTOR t, u, v;
+				const int mask = intersect_triangle_lanes(packet, triangle_lanes::from_record(triangles[primitive_idx]),
+														  minT, closest_t, t, u, v) & active_mask;
+				if (mask == 0)
+				{
+					return;
+				}
+
+				// Only rays that found a closer hit are updated
+				const XMVECTOR select = XMVectorSelectControl(mask & 1, (mask >> 1) & 1, (mask >> 2) & 1, (mask >> 3) & 1);
+				closest_t = XMVectorSelect(closest_t, t, select);
+				closestU = XMVectorSelect(closestU, u, select);
+				closestV = XMVectorSelect(closestV, v, select);
+				for (size_t lane = 0; lane != rays.size(); ++lane)
+				{
+					if (mask & (1 << lane))
+					{
+						closestIdx[lane] = primitive_idx;
+					}
+				}
+				hitMask |= mask;
+			});
+		}
 
-			if (USE_AMBIENT) // add ambient component
+		XMFLOAT4A laneT, laneU, laneV;
+		XMStoreFloat4A(&laneT, closestT);
+		XMStoreFloat4A(&laneU, closestU);
+		XMStoreFloat4A(&laneV, closestV);
+		for (size_t lane = 0; lane != rays.size(); ++lane)
+		{
+			if (hitMask & (1 << lane))
 			{
-				// We always add ambient component to compensate the lack of global illumination
-				// Ambient = material.a * light.a
-				const XMVECTOR materialAmbient = XMLoadFloat3(&p.point.ambient);
-				const XMVECTOR ambientComponent = XMColorModulate(l.ambient, materialAmbient);
-				output = XMVectorAdd(output, ambientComponent);
+				++counters.hits;
+				payloads[lane] = interpolate_hit(triangles[closestIdx[lane]],
+												 (&laneT.x)[lane], (&laneU.x)[lane], (&laneV.x)[lane]);
 			}
+		}
+		return hitMask;
+	}
+
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::intersect_triangle(const ray& ray, const triangle_record& triangle,
+											   float min_t, float max_t, float& t, float& u, float& v) const
+	{
+		using namespace DirectX;
+		const XMVECTOR edge1 = XMLoadFloat3(&triangle.edge1);
+		const XMVECTOR edge2 = XMLoadFloat3(&triangle.edge2);
+
+		const XMVECTOR p = XMVector3Cross(ray.direction, edge2);
+		const float det = XMVectorGetX(XMVector3Dot(edge1, p));
+		// Ray is parallel to the triangle plane
+		if (std::abs(det) < 1e-20f)
+		{
+			return false;
+		}
+		const float invDet = 1.0f / det;
+
+		const XMVECTOR s = XMVectorSubtract(ray.position, XMLoadFloat3(&triangle.v0));
+		u = XMVectorGetX(XMVector3Dot(s, p)) * invDet;
+		if (u < 0.0f || u > 1.0f)
+		{
+			return false;
+		}
+
+		const XMVECTOR q = XMVector3Cross(s, edge1);
+		v = XMVectorGetX(XMVector3Dot(ray.direction, q)) * invDet;
+		if (v < 0.0f || u + v > 1.0f)
+		{
+			return false;
+		}
+
+		t = XMVectorGetX(XMVector3Dot(edge2, q)) * invDet;
+		return t >= min_t && t <= max_t; // limit intersection region
+	}
+
+	template<typename VB, typename RT>
+	payload raytracer<VB, RT>::interpolate_hit(const triangle_record& triangle, float t, float u, float v) const
+	{
+		// Vertex attributes are gathered for the closest hit only
+		std::array<vertex, 3> face;
+		for (size_t i = 0; i != 3; ++i)
+		{
+			const unsigned index = index_buffers[triangle.shape_id]->item(3 * triangle.primitive_id + i);
+			face[i] = vertex_buffers[triangle.shape_id]->item(index);
+		}
+
+		payload hit;
+		hit.depth = t;
+		// Interpolate hit point
+		hit.point = face[0] * (1.0f - u - v) + face[1] * u + face[2] * v;
+		hit.point.normal = triangle.normal;
+		return hit;
+	}
+
+	template<typename VB, typename RT>
+	DirectX::XMVECTOR raytracer<VB, RT>::hit_shader(const payload& p, const ray& camera_ray, sampler& rng) const
+	{
+		// The hit shader is universal for whole scene and uses Phong/Blinn-Phong lighting
+
+		using namespace DirectX;
+
+		XMVECTOR output = XMVectorZero();
+		sample_lights(p, camera_ray, rng, [&](const light_sample& sample) {
+			output = XMVectorAdd(output, sample.ambient);
 
 			// Back-faces are rendered with ambient lighting only, so skip
-			if (XMVectorGetX(XMVector3Dot(lightDir, surfaceNormal)) < 0.0f)
+			if (!sample.bFacesLight)
 			{
-				continue;
+				return;
 			}
 
 			// Check if point is not lit by current light source using ray-tracing
-			ray lightRay(address, lightDir);
-			payload shadowPayload;
-			const bool bIsShadow = trace_ray(lightRay, XMVectorGetX(XMVector3Length(lightVector)), 0.0001f,
-											 shadowPayload, true);
-			if (bIsShadow)
+			const bool bIsShadow = any_hit(sample.shadow_ray, sample.distance, 0.0001f);
+			output = XMVectorAdd(output, bIsShadow ? sample.diffuse_shadowed : sample.diffuse_lit);
+			if (!bIsShadow) // Shadowed areas are not shiny
 			{
-				// Point in a shadow are dimmed for diffuse light
-				shadow = XMVectorReplicate(0.5f);
+				output = XMVectorAdd(output, sample.specular);
 			}
+		});
+		return output;
+	}
 
-			if (USE_DIFFUSE)
+	template<typename VB, typename RT>
+	template<typename F>
+	void raytracer<VB, RT>::sample_lights(const payload& p, const ray& camera_ray, sampler& rng, F&& callback) const
+	{
+		using namespace DirectX;
+		if (emitters.empty())
+		{
+			for (const light& l : lights)
 			{
-				// Add diffuse component
-				// Diffuse = material.d * light.d * shadowCoef * cos(toLightRay <-> normal))
-				const XMVECTOR materialDiffuse = XMLoadFloat3(&p.point.diffuse);
-				XMVECTOR diffuseComponent = XMVectorDotAbsolute(lightDir, surfaceNormal);
-				diffuseComponent = XMColorModulate(diffuseComponent, l.duffuse);
-				diffuseComponent = XMColorModulate(diffuseComponent, shadow);
-				diffuseComponent = XMColorModulate(diffuseComponent, materialDiffuse);
-
-				output = XMVectorAdd(output, diffuseComponent);
+				callback(sample_light(p, camera_ray, l));
 			}
+			return;
+		}
 
-			if (!bIsShadow && USE_SPECULAR) // Shadowed areas are not shiny
-			{
-				// Add specular component
+		const XMVECTOR address = XMLoadFloat3(&p.point.position);
+		const float weight = 1.0f / static_cast<float>(light_samples);
+		for (unsigned i = 0; i != light_samples; ++i)
+		{
+			const emitter_sample emitter = sample_emitter(p, rng);
+			const light l = get_emitter_light(address, emitter.position, emitter.normal, emitter.emission,
+											  weight / emitter.pdf, weight);
+			light_sample sample = sample_light(p, camera_ray, l);
+			// Shadow ray must not reach the emitter itself
+			sample.distance *= 0.999f;
+			callback(sample);
+		}
+	}
 
-				// SpecularPhong = material.s * light.s * cos(reflectedLightRay <-> toCameraRay) ^ shininess
-				// SpecularBlinn = material.s * light.s * cos(0.5 * (toLightRay + toCameraRay) <-> normal) ^ shininess
+	template<typename VB, typename RT>
+	emitter_sample raytracer<VB, RT>::sample_emitter(const payload& p, sampler& rng) const
+	{
+		using namespace DirectX;
+		const float uSelect = rng.next_float();
+		const float u1 = rng.next_float();
+		const float u2 = rng.next_float();
+		return light_tree ? emitters.sample(XMLoadFloat3(&p.point.position), XMLoadFloat3(&p.point.normal), uSelect, u1, u2)
+						  : emitters.sample(uSelect, u1, u2);
+	}
 
-				// Unfortunately Cornell box model does not have material specular value
-				// Thus, I add one myself
-				//const XMVECTOR materialSpecular = XMLoadFloat3(&p.point.specular);
-				const XMVECTOR materialSpecular = XMVectorSplatOne();
-				XMVECTOR specularComponent;
-				if (USE_BLINN_LIGHTING)
-				{
-					// Blinn shading shininess has to be different from regular Phong to achieve
-					// similar results
-					shininess = XMVectorScale(shininess, 0.25f);
-					const XMVECTOR halfDir = XMVector3Normalize(XMVectorAdd(lightDir, cameraDir));
-					specularComponent = XMVectorDotAbsolute(surfaceNormal, halfDir);
-				}
-				else
-				{
-					specularComponent = XMVectorDotAbsolute(reflectedLightDir, cameraDir);
-				}
-				specularComponent = XMVectorPow(specularComponent, shininess);
-				specularComponent = XMColorModulate(specularComponent, materialSpecular);
-				specularComponent = XMColorModulate(specularComponent, l.specular);
-				output = XMVectorAdd(output, specularComponent);
-			}
+	template<typename VB, typename RT>
+	light raytracer<VB, RT>::get_emitter_light(DirectX::FXMVECTOR address, DirectX::FXMVECTOR position,
+											   DirectX::FXMVECTOR normal, DirectX::GXMVECTOR emission,
+											   float scale, float ambient_scale) const
+	{
+		using namespace DirectX;
+		// Point light of the same brightness as the emitter seen from the address.
+		// Emitters are two-sided, winding of light meshes is not reliable
+		const XMVECTOR lightVector = XMVectorSubtract(position, address);
+		const float distanceSquared = XMVectorGetX(XMVector3LengthSq(lightVector));
+		XMVECTOR intensity = XMVectorZero();
+		if (distanceSquared > 0.0f)
+		{
+			const float cosLight = std::abs(XMVectorGetX(XMVector3Dot(normal, lightVector))) / std::sqrt(distanceSquared);
+			intensity = XMVectorScale(emission, cosLight * scale / distanceSquared);
+		}
+
+		const light& defaultLight = lights.front();
+		return {position,
+				XMColorModulate(intensity, XMVectorDivide(defaultLight.specular, defaultLight.duffuse)),
+				intensity,
+				XMVectorScale(defaultLight.ambient, ambient_scale)};
+	}
+
+	template<typename VB, typename RT>
+	float raytracer<VB, RT>::get_reuse_target(const payload& p, const ray& camera_ray, const reservoir_sample& sample) const
+	{
+		using namespace DirectX;
+		const light l = get_emitter_light(XMLoadFloat3(&p.point.position), XMLoadFloat3(&sample.position),
+										  XMLoadFloat3(&sample.normal), XMLoadFloat3(&sample.emission), 1.0f, 0.0f);
+		const light_sample lit = sample_light(p, camera_ray, l);
+		if (!lit.bFacesLight)
+		{
+			return 0.0f;
+		}
+		const XMVECTOR luminance = XMVectorSet(0.2126f, 0.7152f, 0.0722f, 0.0f);
+		return XMVectorGetX(XMVector3Dot(XMVectorAdd(lit.diffuse_lit, lit.specular), luminance));
+	}
+
+	template<typename VB, typename RT>
+	DirectX::XMVECTOR raytracer<VB, RT>::shade_reservoir(const reservoir& r, const payload& p, const ray& camera_ray) const
+	{
+		using namespace DirectX;
+		const light l = get_emitter_light(XMLoadFloat3(&p.point.position), XMLoadFloat3(&r.sample.position),
+										  XMLoadFloat3(&r.sample.normal), XMLoadFloat3(&r.sample.emission),
+										  r.contribution_weight, 1.0f);
+		const light_sample sample = sample_light(p, camera_ray, l);
+		XMVECTOR output = sample.ambient;
+		if (!sample.bFacesLight || r.contribution_weight <= 0.0f)
+		{
+			return output;
+		}
+
+		// Shadow ray must not reach the emitter itself
+		const bool bIsShadow = any_hit(sample.shadow_ray, sample.distance * 0.999f, 0.0001f);
+		output = XMVectorAdd(output, bIsShadow ? sample.diffuse_shadowed : sample.diffuse_lit);
+		if (!bIsShadow) // Shadowed areas are not shiny
+		{
+			output = XMVectorAdd(output, sample.specular);
 		}
 		return output;
 	}
 
+	template<typename VB, typename RT>
+	size_t raytracer<VB, RT>::get_num_light_samples() const
+	{
+		return emitters.empty() ? lights.size() : light_samples;
+	}
+
+	template<typename VB, typename RT>
+	light_sample raytracer<VB, RT>::sample_light(const payload& p, const ray& camera_ray, const light& l) const
+	{
+		using namespace DirectX;
+
+		// HINT: Use this switchers to play with parameters and see how lighting is build
+		constexpr bool USE_BLINN_LIGHTING = false;
+		constexpr bool USE_AMBIENT = true;
+		constexpr bool USE_DIFFUSE = true;
+		constexpr bool USE_SPECULAR = true;
+
+		const XMVECTOR address = XMLoadFloat3(&p.point.position);
+		const XMVECTOR surfaceNormal = XMLoadFloat3(&p.point.normal);
+		const XMVECTOR lightVector = XMVectorSubtract(l.position, address);
+		const XMVECTOR lightDir = XMVector3Normalize(lightVector);
+		const XMVECTOR incidentDir = XMVectorScale(lightDir, -1.0f);
+		const XMVECTOR reflectedLightDir = XMVector3Reflect(incidentDir, surfaceNormal);
+		const XMVECTOR cameraDir = XMVector3Normalize(XMVectorSubtract(camera_ray.position, address));
+		XMVECTOR shininess = XMVectorReplicate(p.point.shininess);
+
+		light_sample sample{XMVectorZero(), XMVectorZero(), XMVectorZero(), XMVectorZero(),
+							ray(address, lightDir), XMVectorGetX(XMVector3Length(lightVector)),
+							XMVectorGetX(XMVector3Dot(lightDir, surfaceNormal)) >= 0.0f};
+
+		if (USE_AMBIENT) // add ambient component
+		{
+			// We always add ambient component to compensate the lack of global illumination
+			// Ambient = material.a * light.a
+			const XMVECTOR materialAmbient = XMLoadFloat3(&p.point.ambient);
+			sample.ambient = XMColorModulate(l.ambient, materialAmbient);
+		}
+
+		if (!sample.bFacesLight)
+		{
+			return sample;
+		}
+
+		if (USE_DIFFUSE)
+		{
+			// Add diffuse component
+			// Diffuse = material.d * light.d * shadowCoef * cos(toLightRay <-> normal))
+			// Point in a shadow are dimmed for diffuse light
+			const XMVECTOR materialDiffuse = XMLoadFloat3(&p.point.diffuse);
+			XMVECTOR diffuseComponent = XMVectorDotAbsolute(lightDir, surfaceNormal);
+			diffuseComponent = XMColorModulate(diffuseComponent, l.duffuse);
+			sample.diffuse_lit = XMColorModulate(diffuseComponent, materialDiffuse);
+			sample.diffuse_shadowed = XMColorModulate(XMColorModulate(diffuseComponent, XMVectorReplicate(0.5f)), materialDiffuse);
+		}
+
+		if (USE_SPECULAR)
+		{
+			// Add specular component
+
+			// SpecularPhong = material.s * light.s * cos(reflectedLightRay <-> toCameraRay) ^ shininess
+			// SpecularBlinn = material.s * light.s * cos(0.5 * (toLightRay + toCameraRay) <-> normal) ^ shininess
+
+			// Unfortunately Cornell box model does not have material specular value
+			// Thus, I add one myself
+			//const XMVECTOR materialSpecular = XMLoadFloat3(&p.point.specular);
+			const XMVECTOR materialSpecular = XMVectorSplatOne();
+			XMVECTOR specularComponent;
+			if (USE_BLINN_LIGHTING)
+			{
+				// Blinn shading shininess has to be different from regular Phong to achieve
+				// similar results
+				shininess = XMVectorScale(shininess, 0.25f);
+				const XMVECTOR halfDir = XMVector3Normalize(XMVectorAdd(lightDir, cameraDir));
+				specularComponent = XMVectorDotAbsolute(surfaceNormal, halfDir);
+			}
+			else
+			{
+				specularComponent = XMVectorDotAbsolute(reflectedLightDir, cameraDir);
+			}
+			specularComponent = XMVectorPow(specularComponent, shininess);
+			specularComponent = XMColorModulate(specularComponent, materialSpecular);
+			sample.specular = XMColorModulate(specularComponent, l.specular);
+		}
+		return sample;
+	}
+
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::bounce_shader(const payload& p, const ray& incoming, sampler& rng,
+										  DirectX::XMVECTOR& throughput, DirectX::XMVECTOR& next_direction,
+										  bool& is_specular) const
+	{
+		using namespace DirectX;
+		// Lobe is picked by its brightness, dividing by the probability of the pick keeps the estimate unbiased
+		const XMVECTOR luminance = XMVectorSet(0.2126f, 0.7152f, 0.0722f, 0.0f);
+		const XMVECTOR materialDiffuse = XMLoadFloat3(&p.point.diffuse);
+		const XMVECTOR materialSpecular = XMLoadFloat3(&p.point.specular);
+		const float diffuseWeight = XMVectorGetX(XMVector3Dot(materialDiffuse, luminance));
+		const float specularWeight = XMVectorGetX(XMVector3Dot(materialSpecular, luminance));
+		if (diffuseWeight + specularWeight <= 0.0f)
+		{
+			return false;
+		}
+
+		// Reflect on the side the ray came from
+		XMVECTOR surfaceNormal = XMVector3Normalize(XMLoadFloat3(&p.point.normal));
+		if (XMVectorGetX(XMVector3Dot(surfaceNormal, incoming.direction)) > 0.0f)
+		{
+			surfaceNormal = XMVectorNegate(surfaceNormal);
+		}
+
+		const float specularProbability = specularWeight / (diffuseWeight + specularWeight);
+		is_specular = rng.next_float() < specularProbability;
+		if (is_specular)
+		{
+			// Mirror reflection
+			throughput = XMColorModulate(throughput, XMVectorScale(materialSpecular, 1.0f / specularProbability));
+			next_direction = XMVector3Reflect(incoming.direction, surfaceNormal);
+		}
+		else
+		{
+			// Lambertian reflection, cosine of the sampled direction cancels out with its pdf
+			const float u1 = rng.next_float();
+			const float u2 = rng.next_float();
+			throughput = XMColorModulate(throughput, XMVectorScale(materialDiffuse, 1.0f / (1.0f - specularProbability)));
+			next_direction = sample_cosine_hemisphere(surfaceNormal, u1, u2);
+		}
+		return true;
+	}
+
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::russian_roulette(unsigned depth, sampler& rng, DirectX::XMVECTOR& throughput)
+	{
+		using namespace DirectX;
+		if (depth < 2)
+		{
+			return true;
+		}
+		const float survival = std::min(1.0f, std::max({XMVectorGetX(throughput), XMVectorGetY(throughput),
+														XMVectorGetZ(throughput)}));
+		if (survival <= 0.0f || rng.next_float() >= survival)
+		{
+			return false;
+		}
+		throughput = XMVectorScale(throughput, 1.0f / survival);
+		return true;
+	}
+
 	template<typename VB, typename RT>
 	DirectX::XMVECTOR raytracer<VB, RT>::miss_shader(const payload& p, const ray& camera_ray) const
 	{
@@ -619,6 +1784,13 @@ namespace cg::renderer
 		return false;
 	}
 
+	template<typename VB, typename RT>
+	DirectX::XMVECTOR raytracer<VB, RT>::get_background_color(size_t x, size_t y) const
+	{
+		// some interesting gradient
+		return DirectX::XMVectorSet(static_cast<float>(x) / width, static_cast<float>(y) / height, 1.0f, 0.0f);
+	}
+
 	template<typename VB, typename RT>
 	DirectX::XMFLOAT2 raytracer<VB, RT>::get_jitter(size_t frame_id)
 	{
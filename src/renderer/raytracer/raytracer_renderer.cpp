@@ -1,5 +1,6 @@
 #include "raytracer_renderer.h"
 
+#include "utils/mapped_file.h"
 #include "utils/resource_utils.h"
 
 #include <iostream>
@@ -30,6 +31,26 @@ void cg::renderer::ray_tracing_renderer::init()
 	ray_tracer->set_viewport(settings->width, settings->height);
 	ray_tracer->set_render_target(render_target);
 	ray_tracer->set_camera(camera);
+	ray_tracer->set_scheduler(std::make_shared<utils::tile_scheduler>(settings->num_threads, settings->tile_size));
+	ray_tracer->set_bvh_width(settings->bvh_width);
+	ray_tracer->set_packet_tracing(settings->ray_packets);
+	ray_tracer->set_wavefront(settings->wavefront);
+	ray_tracer->set_raytracing_depth(settings->raytracing_depth);
+	ray_tracer->set_ray_budget(settings->ray_budget);
+	ray_tracer->set_light_samples(settings->light_samples);
+	ray_tracer->set_light_tree(settings->light_tree);
+	ray_tracer->set_light_reuse(settings->light_reuse, settings->reuse_candidates);
+	if (settings->denoise_iterations > 0)
+	{
+		ray_tracer->set_feature_targets({std::make_shared<resource<color>>(settings->width, settings->height),
+										 std::make_shared<resource<color>>(settings->width, settings->height),
+										 std::make_shared<resource<float>>(settings->width, settings->height)});
+	}
+	if (settings->heatmap)
+	{
+		traversal_cost = std::make_shared<resource<float>>(settings->width, settings->height);
+		ray_tracer->set_traversal_cost_target(traversal_cost);
+	}
 }
 
 void cg::renderer::ray_tracing_renderer::destroy()
@@ -48,16 +69,47 @@ void cg::renderer::ray_tracing_renderer::render()
 	ray_tracer->set_vertex_buffers(vertexBuffers);
 	ray_tracer->set_index_buffers(indexBuffers);
 
-	ray_tracer->build_acceleration_structure();
+	// Reuse hierarchy built by a previous run for the same model file
+	std::filesystem::path cache_path = settings->model_path;
+	cache_path.replace_extension(".bvh");
+	const uint64_t model_hash = utils::hash_file(settings->model_path);
+	if (!ray_tracer->load_acceleration_structure(cache_path, model_hash))
+	{
+		ray_tracer->build_acceleration_structure();
+		try
+		{
+			ray_tracer->save_acceleration_structure(cache_path, model_hash);
+		}
+		catch (std::exception& e)
+		{
+			// Rendering doesn't depend on the cache, e.g. model folder may be read-only
+			std::cerr << "Warning: can't cache acceleration structure: " << e.what() << std::endl;
+		}
+	}
 
 	// render some frames since TAA effect comes after some time
-	for (size_t frame = 0; frame != 10; ++frame)
+	const size_t num_frames = std::max(1u, settings->accumulation_num);
+	for (size_t frame = 0; frame != num_frames; ++frame)
 	{
 		std::cerr << "Rendering frame " << frame << "...\r" << std::flush;
-		ray_tracer->clear_render_target();
 		ray_tracer->launch_ray_generation(frame);
 	}
 
-	// save and show last frame
+	// save and show averaged frames
+	if (settings->denoise_iterations > 0)
+	{
+		ray_tracer->denoise_accumulation(settings->denoise_iterations);
+	}
+	ray_tracer->resolve_accumulation();
 	utils::save_resource(*render_target, settings->result_path);
+
+	// Statistics and heatmap are named after the result, e.g. result_stats.json
+	const std::filesystem::path result_stem = settings->result_path.parent_path() / settings->result_path.stem();
+	ray_tracer->get_stats().save_json(result_stem.string() + "_stats.json");
+	if (traversal_cost)
+	{
+		resource<unsigned_color> heatmap(settings->width, settings->height);
+		make_heatmap(*traversal_cost, heatmap);
+		utils::save_resource(heatmap, result_stem.string() + "_heatmap.png");
+	}
 }
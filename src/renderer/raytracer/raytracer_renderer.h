@@ -17,6 +17,7 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<cg::world::camera> camera;
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
+		std::shared_ptr<cg::resource<float>> traversal_cost;
 		std::shared_ptr<cg::world::model> model;
 
 		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> ray_tracer;
@@ -0,0 +1,78 @@
+#include "render_stats.h"
+
+#include "utils/error_handler.h"
+
+#include <fstream>
+#include <numeric>
+
+
+cg::renderer::trace_counters& cg::renderer::trace_counters::operator+=(const trace_counters& other)
+{
+	primary_rays += other.primary_rays;
+	shadow_rays += other.shadow_rays;
+	bounce_rays += other.bounce_rays;
+	boxes_tested += other.boxes_tested;
+	triangles_tested += other.triangles_tested;
+	hits += other.hits;
+	return *this;
+}
+
+void cg::renderer::render_stats::reset(size_t in_width, size_t in_height)
+{
+	width = in_width;
+	height = in_height;
+	counters = {};
+	frame_times_ms.clear();
+}
+
+void cg::renderer::render_stats::save_json(const std::filesystem::path& path) const
+{
+	std::ofstream file(path, std::ios::trunc);
+
+	const double totalTime = std::accumulate(frame_times_ms.begin(), frame_times_ms.end(), 0.0);
+	const uint64_t totalRays = counters.primary_rays + counters.shadow_rays + counters.bounce_rays;
+
+	file << "{\n";
+	file << "\t\"width\": " << width << ",\n";
+	file << "\t\"height\": " << height << ",\n";
+	file << "\t\"frames\": " << frame_times_ms.size() << ",\n";
+	file << "\t\"primary_rays\": " << counters.primary_rays << ",\n";
+	file << "\t\"shadow_rays\": " << counters.shadow_rays << ",\n";
+	file << "\t\"bounce_rays\": " << counters.bounce_rays << ",\n";
+	file << "\t\"boxes_tested\": " << counters.boxes_tested << ",\n";
+	file << "\t\"triangles_tested\": " << counters.triangles_tested << ",\n";
+	file << "\t\"hits\": " << counters.hits << ",\n";
+	file << "\t\"total_time_ms\": " << totalTime << ",\n";
+	file << "\t\"rays_per_second\": " << (totalTime > 0.0 ? totalRays * 1000.0 / totalTime : 0.0) << ",\n";
+	file << "\t\"frame_time_ms\": [";
+	for (size_t i = 0; i != frame_times_ms.size(); ++i)
+	{
+		file << (i == 0 ? "" : ", ") << frame_times_ms[i];
+	}
+	file << "]\n";
+	file << "}\n";
+
+	if (!file)
+	{
+		THROW_ERROR("Can't write " + path.string());
+	}
+}
+
+void cg::renderer::make_heatmap(resource<float>& cost, resource<unsigned_color>& heatmap)
+{
+	float maxCost = 0.0f;
+	for (size_t i = 0; i != cost.get_number_of_elements(); ++i)
+	{
+		maxCost = std::max(maxCost, cost.item(i));
+	}
+
+	for (size_t i = 0; i != cost.get_number_of_elements(); ++i)
+	{
+		// Piecewise linear blue -> cyan -> green -> yellow -> red ramp
+		const float t = maxCost > 0.0f ? cost.item(i) / maxCost : 0.0f;
+		const float r = std::clamp(4.0f * t - 2.0f, 0.0f, 1.0f);
+		const float g = std::clamp(t < 0.75f ? 4.0f * t : 4.0f - 4.0f * t, 0.0f, 1.0f);
+		const float b = std::clamp(2.0f - 4.0f * t, 0.0f, 1.0f);
+		heatmap.item(i) = unsigned_color::from_color({r, g, b});
+	}
+}
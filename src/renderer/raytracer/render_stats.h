@@ -0,0 +1,47 @@
+#pragma once
+
+#include "resource.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace cg::renderer
+{
+	// Work done while tracing rays
+	struct trace_counters
+	{
+		uint64_t primary_rays = 0;
+		uint64_t shadow_rays = 0;
+		uint64_t bounce_rays = 0;
+		uint64_t boxes_tested = 0;
+		uint64_t triangles_tested = 0;
+		uint64_t hits = 0;
+
+		// Traversal cost used for the heatmap
+		uint64_t get_cost() const { return boxes_tested + triangles_tested; }
+
+		trace_counters& operator+=(const trace_counters& other);
+	};
+
+	// Counters of the calling thread, so tracing never synchronizes on them.
+	// They are merged into the frame totals once per tile
+	inline thread_local trace_counters thread_counters;
+
+
+	// Totals of a whole render
+	struct render_stats
+	{
+		size_t width = 0;
+		size_t height = 0;
+		trace_counters counters;
+		std::vector<double> frame_times_ms;
+
+		void reset(size_t in_width, size_t in_height);
+
+		void save_json(const std::filesystem::path& path) const;
+	};
+
+	// False-colour image of per-pixel cost from blue (cheapest) to red (most expensive)
+	void make_heatmap(resource<float>& cost, resource<unsigned_color>& heatmap);
+}// namespace cg::renderer
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "DirectXMath.h"
+
+namespace cg::renderer
+{
+	// Point on an emissive triangle kept by a reservoir
+	struct reservoir_sample
+	{
+		DirectX::XMFLOAT3 position;
+		DirectX::XMFLOAT3 normal;
+		DirectX::XMFLOAT3 emission;
+	};
+
+
+	// Weighted reservoir of light samples of one pixel (ReSTIR DI). It keeps a single sample
+	// chosen from a stream of candidates in proportion to their weights, so reservoirs of other frames
+	// and pixels are merged like any other candidate
+	struct reservoir
+	{
+		reservoir_sample sample{};
+		float target = 0.0f; // target function of the sample at the pixel owning the reservoir
+		float weight_sum = 0.0f;
+		float m = 0.0f; // number of candidates seen
+		float contribution_weight = 0.0f; // W, replaces 1 / pdf of the sample
+
+		// Stream in a candidate standing for count candidates, u in [0, 1) decides whether it is kept
+		bool update(const reservoir_sample& candidate, float candidate_target, float weight, float count, float u)
+		{
+			weight_sum += weight;
+			m += count;
+			if (weight > 0.0f && u * weight_sum < weight)
+			{
+				sample = candidate;
+				target = candidate_target;
+				return true;
+			}
+			return false;
+		}
+
+		void finalize()
+		{
+			contribution_weight = target > 0.0f && m > 0.0f ? weight_sum / (m * target) : 0.0f;
+		}
+	};
+}// namespace cg::renderer
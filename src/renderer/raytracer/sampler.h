@@ -0,0 +1,67 @@
+#pragma once
+
+#include "DirectXMath.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace cg::renderer
+{
+	// PCG32 generator. Paths seed it by pixel, frame and bounce,
+	// so the image doesn't depend on the order rays are traced in
+	class sampler
+	{
+	public:
+		sampler(uint64_t seed, uint64_t sequence)
+		{
+			increment = (sequence << 1u) | 1u;
+			next_uint();
+			state += seed;
+			next_uint();
+		}
+
+		uint32_t next_uint()
+		{
+			const uint64_t oldState = state;
+			state = oldState * 6364136223846793005ull + increment;
+			const uint32_t xorShifted = static_cast<uint32_t>(((oldState >> 18u) ^ oldState) >> 27u);
+			const uint32_t rotation = static_cast<uint32_t>(oldState >> 59u);
+			return (xorShifted >> rotation) | (xorShifted << ((32u - rotation) & 31u));
+		}
+
+		// Uniform in [0, 1)
+		float next_float()
+		{
+			return static_cast<float>(next_uint() >> 8) * (1.0f / 16777216.0f);
+		}
+
+	protected:
+		uint64_t state = 0;
+		uint64_t increment = 1;
+	};
+
+
+	// Direction in the hemisphere around the normal with pdf cos(theta) / pi
+	inline DirectX::XMVECTOR sample_cosine_hemisphere(DirectX::FXMVECTOR normal, float u1, float u2)
+	{
+		using namespace DirectX;
+		const float radius = std::sqrt(u1);
+		const float phi = XM_2PI * u2;
+		const float x = radius * std::cos(phi);
+		const float y = radius * std::sin(phi);
+		const float z = std::sqrt(std::max(0.0f, 1.0f - u1));
+
+		// Orthonormal basis without branches on the normal direction (Duff et al.)
+		const float nx = XMVectorGetX(normal);
+		const float ny = XMVectorGetY(normal);
+		const float nz = XMVectorGetZ(normal);
+		const float sign = std::copysign(1.0f, nz);
+		const float a = -1.0f / (sign + nz);
+		const float b = nx * ny * a;
+		const XMVECTOR tangent = XMVectorSet(1.0f + sign * nx * nx * a, sign * b, -sign * nx, 0.0f);
+		const XMVECTOR bitangent = XMVectorSet(b, sign + ny * ny * a, -ny, 0.0f);
+
+		return XMVectorAdd(XMVectorAdd(XMVectorScale(tangent, x), XMVectorScale(bitangent, y)), XMVectorScale(normal, z));
+	}
+}// namespace cg::renderer
@@ -98,6 +98,18 @@ namespace cg
 			return { in.x, in.y, in.z };
 		}
 
+		static color from_xmvector(const DirectX::FXMVECTOR in)
+		{
+			DirectX::XMFLOAT3 temp;
+			DirectX::XMStoreFloat3(&temp, in);
+			return from_XMFLOAT3(temp);
+		}
+
+		DirectX::XMVECTOR to_xmvector() const
+		{
+			return DirectX::XMVectorSet(r, g, b, 0.0f);
+		}
+
 		float3 to_float3() const
 		{
 			//THROW_ERROR("Not implemented yet");
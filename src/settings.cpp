@@ -24,7 +24,19 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("camera_z_far", "Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
-	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("ray_budget", "Maximum number of rays traced for a pixel in one frame, shadow rays included", cxxopts::value<unsigned>()->default_value("64"));
+	add_options("light_samples", "Number of points sampled on emissive triangles for every hit", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("light_tree", "Sample emissive triangles through a light hierarchy by their importance to the hit", cxxopts::value<bool>()->default_value("false"));
+	add_options("light_reuse", "Reuse light samples of primary hits across frames and neighbouring pixels (ReSTIR)", cxxopts::value<bool>()->default_value("false"));
+	add_options("reuse_candidates", "Number of light candidates a pixel draws per frame for light reuse", cxxopts::value<unsigned>()->default_value("8"));
+	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("10"));
+	add_options("denoise_iterations", "Iterations of the a-trous denoiser run on accumulated frames, 0 disables it", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("num_threads", "Number of render threads, 0 to use all cores", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("tile_size", "Size of a square tile processed by a render thread", cxxopts::value<unsigned>()->default_value("32"));
+	add_options("bvh_width", "Children per node of the raytracer hierarchy, 2 or 4", cxxopts::value<unsigned>()->default_value("4"));
+	add_options("ray_packets", "Trace primary rays of 2x2 pixel blocks together, through the hierarchy of --bvh_width", cxxopts::value<bool>()->default_value("false"));
+	add_options("wavefront", "Trace rays of a tile stage by stage through sorted queues", cxxopts::value<bool>()->default_value("false"));
+	add_options("heatmap", "Save per-pixel traversal cost of the raytracer next to the result", cxxopts::value<bool>()->default_value("false"));
 	add_options("h,help", "Print usage");
 
 	auto result = options.parse(argc, argv);
@@ -45,7 +57,19 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->camera_z_far = result["camera_z_far"].as<float>();
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
+	settings->ray_budget = result["ray_budget"].as<unsigned>();
+	settings->light_samples = result["light_samples"].as<unsigned>();
+	settings->light_tree = result["light_tree"].as<bool>();
+	settings->light_reuse = result["light_reuse"].as<bool>();
+	settings->reuse_candidates = result["reuse_candidates"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->denoise_iterations = result["denoise_iterations"].as<unsigned>();
+	settings->num_threads = result["num_threads"].as<unsigned>();
+	settings->tile_size = result["tile_size"].as<unsigned>();
+	settings->bvh_width = result["bvh_width"].as<unsigned>();
+	settings->ray_packets = result["ray_packets"].as<bool>();
+	settings->wavefront = result["wavefront"].as<bool>();
+	settings->heatmap = result["heatmap"].as<bool>();
 
 	return settings;
 }
@@ -26,7 +26,22 @@ namespace cg
 		std::filesystem::path result_path;
 
 		unsigned raytracing_depth;
+		unsigned ray_budget;
+		unsigned light_samples;
+		bool light_tree;
+		bool light_reuse;
+		unsigned reuse_candidates;
 		unsigned accumulation_num;
+		unsigned denoise_iterations;
+
+		unsigned num_threads;
+		unsigned tile_size;
+
+		unsigned bvh_width;
+		bool ray_packets;
+		bool wavefront;
+
+		bool heatmap;
 	};
 
 }// namespace cg
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "mapped_file.h"
+
+#include "utils/error_handler.h"
+
+#include <random>
+#include <sstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+using namespace cg::utils;
+
+cg::utils::mapped_file::mapped_file(const std::filesystem::path& path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+							  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		THROW_ERROR("Can't open " + path.string());
+	}
+	file_handle = file;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size))
+	{
+		CloseHandle(file);
+		THROW_ERROR("Can't get size of " + path.string());
+	}
+	size = static_cast<size_t>(file_size.QuadPart);
+	if (size == 0)
+	{
+		return;
+	}
+
+	HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		THROW_ERROR("Can't map " + path.string());
+	}
+	mapping_handle = mapping;
+	data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!data)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		THROW_ERROR("Can't map " + path.string());
+	}
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file == -1)
+	{
+		THROW_ERROR("Can't open " + path.string());
+	}
+
+	struct stat file_stat;
+	if (fstat(file, &file_stat) != 0)
+	{
+		close(file);
+		THROW_ERROR("Can't get size of " + path.string());
+	}
+	size = static_cast<size_t>(file_stat.st_size);
+	if (size != 0)
+	{
+		void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (view == MAP_FAILED)
+		{
+			close(file);
+			THROW_ERROR("Can't map " + path.string());
+		}
+		data = static_cast<const unsigned char*>(view);
+	}
+	// Mapping stays valid after the descriptor is closed
+	close(file);
+#endif
+}
+
+cg::utils::mapped_file::~mapped_file()
+{
+#ifdef _WIN32
+	if (data)
+	{
+		UnmapViewOfFile(data);
+	}
+	if (mapping_handle)
+	{
+		CloseHandle(mapping_handle);
+	}
+	if (file_handle)
+	{
+		CloseHandle(file_handle);
+	}
+#else
+	if (data)
+	{
+		munmap(const_cast<unsigned char*>(data), size);
+	}
+#endif
+}
+
+const unsigned char* cg::utils::mapped_file::get_data() const
+{
+	return data;
+}
+
+size_t cg::utils::mapped_file::get_size() const
+{
+	return size;
+}
+
+uint64_t cg::utils::hash_file(const std::filesystem::path& path)
+{
+	const mapped_file file(path);
+
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i != file.get_size(); ++i)
+	{
+		hash ^= file.get_data()[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::filesystem::path cg::utils::get_temp_path(const std::filesystem::path& path)
+{
+#ifdef _WIN32
+	const unsigned long process_id = GetCurrentProcessId();
+#else
+	const unsigned long process_id = static_cast<unsigned long>(getpid());
+#endif
+	// Threads of one process are told apart by the random suffix
+	std::random_device random;
+	const uint64_t suffix = (static_cast<uint64_t>(random()) << 32) | random();
+
+	std::ostringstream name;
+	name << path.filename().string() << "." << process_id << "." << std::hex << suffix << ".tmp";
+	return path.parent_path() / name.str();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+
+namespace cg::utils
+{
+	// Read-only view of a whole file mapped into the address space
+	class mapped_file
+	{
+	public:
+		mapped_file(const std::filesystem::path& path);
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		const unsigned char* get_data() const;
+		size_t get_size() const;
+
+	private:
+		const unsigned char* data = nullptr;
+		size_t size = 0;
+
+		// Native handles of the file and its mapping on Windows
+		void* file_handle = nullptr;
+		void* mapping_handle = nullptr;
+	};
+
+	// 64-bit FNV-1a hash of the file content, used to key cache files
+	uint64_t hash_file(const std::filesystem::path& path);
+
+	// Name next to the path unique to the calling process and call. Cache files are written there
+	// and renamed into place, so concurrent jobs never map or truncate each other's partial files
+	std::filesystem::path get_temp_path(const std::filesystem::path& path);
+}// namespace cg::utils
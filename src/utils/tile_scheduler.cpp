@@ -0,0 +1,167 @@
+#include "tile_scheduler.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+
+
+using namespace cg::utils;
+
+cg::utils::tile_scheduler::tile_scheduler(unsigned in_num_threads, size_t in_tile_size) :
+	num_threads(in_num_threads), tile_size(in_tile_size)
+{
+	if (tile_size == 0)
+	{
+		THROW_ERROR("Tile size has to be positive");
+	}
+	if (num_threads == 0)
+	{
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	for (unsigned i = 0; i != num_threads; ++i)
+	{
+		queues.emplace_back(std::make_unique<worker_queue>());
+	}
+	// Worker 0 is the thread calling run()
+	for (unsigned i = 1; i != num_threads; ++i)
+	{
+		workers.emplace_back(&tile_scheduler::worker_loop, this, i);
+	}
+}
+
+cg::utils::tile_scheduler::~tile_scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	start_condition.notify_all();
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+void cg::utils::tile_scheduler::run(size_t width, size_t height, const std::function<void(const tile&)>& kernel)
+{
+	// Split the frame into row-major tiles and give each worker a contiguous range of them,
+	// so that neighbouring tiles are processed by the same core unless stolen
+	std::vector<tile> tiles;
+	for (size_t y = 0; y < height; y += tile_size)
+	{
+		for (size_t x = 0; x < width; x += tile_size)
+		{
+			tiles.push_back({x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+		}
+	}
+	for (unsigned i = 0; i != num_threads; ++i)
+	{
+		const size_t from = tiles.size() * i / num_threads;
+		const size_t to = tiles.size() * (i + 1) / num_threads;
+		std::lock_guard<std::mutex> lock(queues[i]->mutex);
+		queues[i]->tiles.assign(tiles.begin() + from, tiles.begin() + to);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		current_kernel = &kernel;
+		busy_workers = num_threads - 1;
+		error = nullptr;
+		++generation;
+	}
+	start_condition.notify_all();
+
+	process_tiles(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done_condition.wait(lock, [this] { return busy_workers == 0; });
+	current_kernel = nullptr;
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+unsigned cg::utils::tile_scheduler::get_num_threads() const
+{
+	return num_threads;
+}
+
+size_t cg::utils::tile_scheduler::get_tile_size() const
+{
+	return tile_size;
+}
+
+void cg::utils::tile_scheduler::worker_loop(unsigned worker_idx)
+{
+	size_t seen_generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_condition.wait(lock, [&] { return stop || generation != seen_generation; });
+			if (stop)
+			{
+				return;
+			}
+			seen_generation = generation;
+		}
+
+		process_tiles(worker_idx);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--busy_workers;
+		}
+		done_condition.notify_one();
+	}
+}
+
+void cg::utils::tile_scheduler::process_tiles(unsigned worker_idx)
+{
+	tile current_tile;
+	while (pop_tile(worker_idx, current_tile))
+	{
+		try
+		{
+			(*current_kernel)(current_tile);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error)
+			{
+				error = std::current_exception();
+			}
+		}
+	}
+}
+
+bool cg::utils::tile_scheduler::pop_tile(unsigned worker_idx, tile& out_tile)
+{
+	// Take own work from the front
+	{
+		worker_queue& own = *queues[worker_idx];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tiles.empty())
+		{
+			out_tile = own.tiles.front();
+			own.tiles.pop_front();
+			return true;
+		}
+	}
+	// Steal from the back of other queues, far from where their owners are working
+	for (unsigned i = 1; i != num_threads; ++i)
+	{
+		worker_queue& victim = *queues[(worker_idx + i) % num_threads];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tiles.empty())
+		{
+			out_tile = victim.tiles.back();
+			victim.tiles.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
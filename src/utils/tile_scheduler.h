@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace cg::utils
+{
+	// Rectangular region of the frame, end coordinates are exclusive
+	struct tile
+	{
+		size_t x_begin;
+		size_t y_begin;
+		size_t x_end;
+		size_t y_end;
+	};
+
+	// Pool of worker threads processing a frame tile by tile.
+	// Every worker owns a queue of tiles and steals from others when it runs out of work
+	class tile_scheduler
+	{
+	public:
+		// 0 threads means one per hardware thread
+		tile_scheduler(unsigned in_num_threads = 0, size_t in_tile_size = 32);
+		~tile_scheduler();
+
+		tile_scheduler(const tile_scheduler&) = delete;
+		tile_scheduler& operator=(const tile_scheduler&) = delete;
+
+		// Call kernel for every tile of width x height frame and wait until all of them are done.
+		// The calling thread takes part in the work
+		void run(size_t width, size_t height, const std::function<void(const tile&)>& kernel);
+
+		unsigned get_num_threads() const;
+		size_t get_tile_size() const;
+
+	private:
+		struct worker_queue
+		{
+			std::mutex mutex;
+			std::deque<tile> tiles;
+		};
+
+		void worker_loop(unsigned worker_idx);
+		void process_tiles(unsigned worker_idx);
+		bool pop_tile(unsigned worker_idx, tile& out_tile);
+
+		unsigned num_threads;
+		size_t tile_size;
+
+		std::vector<std::thread> workers;
+		std::vector<std::unique_ptr<worker_queue>> queues;
+
+		std::mutex mutex;
+		std::condition_variable start_condition;
+		std::condition_variable done_condition;
+		const std::function<void(const tile&)>* current_kernel = nullptr;
+		size_t generation = 0;
+		unsigned busy_workers = 0;
+		bool stop = false;
+		std::exception_ptr error;
+	};
+}// namespace cg::utils
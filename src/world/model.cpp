@@ -3,12 +3,17 @@
 #include "model.h"
 
 #include "utils/error_handler.h"
+#include "utils/mapped_file.h"
 
 #include <DirectXMath.h>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <set>
 #include <linalg.h>
 #include <random>
+#include <sstream>
+#include <string_view>
 
 
 using namespace linalg::aliases;
@@ -18,7 +23,203 @@ cg::world::model::model() {}
 
 cg::world::model::~model() {}
 
+namespace
+{
+	// Cache file is the header, then a table of buffer sizes per shape,
+	// then vertex and index buffers of every shape as they are in memory
+	struct mesh_file_header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint32_t vertex_size;
+		uint32_t num_shapes;
+	};
+
+	struct mesh_file_shape
+	{
+		uint64_t num_vertices;
+		uint64_t num_indices;
+	};
+
+	constexpr char mesh_file_magic[4] = {'M', 'E', 'S', 'H'};
+
+	// Materials are baked into vertices, so material libraries are a part of the key too
+	uint64_t hash_model_files(const std::filesystem::path& model_path)
+	{
+		uint64_t key = cg::utils::hash_file(model_path);
+
+		const cg::utils::mapped_file obj(model_path);
+		const std::string_view text(reinterpret_cast<const char*>(obj.get_data()), obj.get_size());
+		for (size_t pos = text.find("mtllib"); pos != std::string_view::npos; pos = text.find("mtllib", pos + 1))
+		{
+			if (pos != 0 && text[pos - 1] != '\n')
+			{
+				continue;
+			}
+			const size_t line_end = std::min(text.find('\n', pos), text.size());
+			std::istringstream names(std::string(text.substr(pos + 6, line_end - pos - 6)));
+			std::string name;
+			while (names >> name)
+			{
+				const std::filesystem::path library_path = model_path.parent_path() / name;
+				if (std::filesystem::exists(library_path))
+				{
+					key = (key ^ cg::utils::hash_file(library_path)) * 1099511628211ull;
+				}
+			}
+		}
+		return key;
+	}
+}
+
 void cg::world::model::load_obj(const std::filesystem::path& model_path)
+{
+	// Parsing text OBJ is slow, so parsed buffers are cached next to the model
+	std::filesystem::path cache_path = model_path;
+	cache_path.replace_extension(".mesh");
+	const uint64_t key = hash_model_files(model_path);
+	if (load_cache(cache_path, key))
+	{
+		return;
+	}
+
+	parse_obj(model_path);
+	try
+	{
+		save_cache(cache_path, key);
+	}
+	catch (std::exception& e)
+	{
+		// Loading doesn't depend on the cache, e.g. model folder may be read-only
+		std::cerr << "Warning: can't cache model: " << e.what() << std::endl;
+	}
+}
+
+bool cg::world::model::load_cache(const std::filesystem::path& cache_path, uint64_t key)
+{
+	if (!std::filesystem::exists(cache_path))
+	{
+		return false;
+	}
+
+	const utils::mapped_file file(cache_path);
+	const unsigned char* data = file.get_data();
+	const size_t size = file.get_size();
+
+	mesh_file_header header;
+	if (size < sizeof(header))
+	{
+		return false;
+	}
+	std::memcpy(&header, data, sizeof(header));
+	if (std::memcmp(header.magic, mesh_file_magic, sizeof(header.magic)) != 0 ||
+		header.version != cache_version || header.key != key || header.vertex_size != sizeof(vertex))
+	{
+		return false;
+	}
+
+	// Every count is bounded by the bytes left before it is multiplied, so sizes can't overflow
+	size_t offset = sizeof(header);
+	if (header.num_shapes > (size - offset) / sizeof(mesh_file_shape))
+	{
+		return false;
+	}
+	std::vector<mesh_file_shape> table(header.num_shapes);
+	std::memcpy(table.data(), data + offset, table.size() * sizeof(mesh_file_shape));
+	offset += table.size() * sizeof(mesh_file_shape);
+
+	size_t expected_size = offset;
+	for (const mesh_file_shape& shape : table)
+	{
+		if (shape.num_vertices > (size - expected_size) / sizeof(vertex))
+		{
+			return false;
+		}
+		expected_size += shape.num_vertices * sizeof(vertex);
+		if (shape.num_indices > (size - expected_size) / sizeof(unsigned int))
+		{
+			return false;
+		}
+		expected_size += shape.num_indices * sizeof(unsigned int);
+	}
+	if (size != expected_size)
+	{
+		return false;
+	}
+
+	// Every buffer is a single bulk copy straight from the mapping
+	vertex_buffers.clear();
+	index_buffers.clear();
+	for (const mesh_file_shape& shape : table)
+	{
+		auto vertex_buffer = std::make_shared<resource<vertex>>(static_cast<size_t>(shape.num_vertices));
+		if (shape.num_vertices)
+		{
+			std::memcpy(&vertex_buffer->item(0), data + offset, vertex_buffer->get_size_in_bytes());
+		}
+		offset += vertex_buffer->get_size_in_bytes();
+
+		auto index_buffer = std::make_shared<resource<unsigned int>>(static_cast<size_t>(shape.num_indices));
+		if (shape.num_indices)
+		{
+			std::memcpy(&index_buffer->item(0), data + offset, index_buffer->get_size_in_bytes());
+		}
+		offset += index_buffer->get_size_in_bytes();
+
+		// Renderers index vertex buffers without checks, so a corrupt file is rejected as a whole
+		for (size_t i = 0; i != index_buffer->get_number_of_elements(); ++i)
+		{
+			if (index_buffer->item(i) >= shape.num_vertices)
+			{
+				vertex_buffers.clear();
+				index_buffers.clear();
+				return false;
+			}
+		}
+
+		vertex_buffers.emplace_back(vertex_buffer);
+		index_buffers.emplace_back(index_buffer);
+	}
+	return true;
+}
+
+void cg::world::model::save_cache(const std::filesystem::path& cache_path, uint64_t key) const
+{
+	mesh_file_header header;
+	std::memcpy(header.magic, mesh_file_magic, sizeof(header.magic));
+	header.version = cache_version;
+	header.key = key;
+	header.vertex_size = sizeof(vertex);
+	header.num_shapes = static_cast<uint32_t>(vertex_buffers.size());
+
+	// Write into a file of this job only, the complete one is renamed into place
+	const std::filesystem::path temp_path = utils::get_temp_path(cache_path);
+	{
+		std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		for (size_t i = 0; i != vertex_buffers.size(); ++i)
+		{
+			const mesh_file_shape shape{vertex_buffers[i]->get_number_of_elements(),
+										index_buffers[i]->get_number_of_elements()};
+			file.write(reinterpret_cast<const char*>(&shape), sizeof(shape));
+		}
+		for (size_t i = 0; i != vertex_buffers.size(); ++i)
+		{
+			file.write(reinterpret_cast<const char*>(vertex_buffers[i]->get_data()), vertex_buffers[i]->get_size_in_bytes());
+			file.write(reinterpret_cast<const char*>(index_buffers[i]->get_data()), index_buffers[i]->get_size_in_bytes());
+		}
+		if (!file)
+		{
+			file.close();
+			std::filesystem::remove(temp_path);
+			THROW_ERROR("Can't write " + temp_path.string());
+		}
+	}
+	std::filesystem::rename(temp_path, cache_path);
+}
+
+void cg::world::model::parse_obj(const std::filesystem::path& model_path)
 {
 	//THROW_ERROR("Not implemented yet");
 	std::string error_message, warning_message;
@@ -2,6 +2,7 @@
 
 #include "resource.h"
 
+#include <cstdint>
 #include <filesystem>
 #include <linalg.h>
 #include <tiny_obj_loader.h>
@@ -27,7 +28,15 @@ namespace cg::world
 
 		const DirectX::XMMATRIX get_world_matrix() const;
 
+		static constexpr uint32_t cache_version = 1;
+
 	protected:
+		void parse_obj(const std::filesystem::path& model_path);
+
+		// Binary copy of vertex and index buffers, key has to identify the source files
+		bool load_cache(const std::filesystem::path& cache_path, uint64_t key);
+		void save_cache(const std::filesystem::path& cache_path, uint64_t key) const;
+
 		tinyobj::attrib_t attrib;
 		std::vector<tinyobj::shape_t> shapes;
 		std::vector<tinyobj::material_t> materials;